@@ -26,86 +26,1221 @@
   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <avr/pgmspace.h>
 #include "AdvancedSerial.h"
 
+//CRC-16 lookup table, generated by the compiler and kept in flash
+template<unsigned long crc, byte bits> struct ChecksumEntry {
+	static const unsigned long next = (crc & 0x8000UL) ? (((crc << 1) ^ CHECKSUM_POLYNOMIAL) & 0xFFFFUL) : ((crc << 1) & 0xFFFFUL);
+	static const unsigned long value = ChecksumEntry<next, bits-1>::value;
+};
+
+template<unsigned long crc> struct ChecksumEntry<crc, 0> {
+	static const unsigned long value = crc;
+};
+
+#define CHECKSUM_ENTRY(index) ((uint16_t)ChecksumEntry<((unsigned long)(index)) << 8, 8>::value)
+#define CHECKSUM_ROW(row) \
+	CHECKSUM_ENTRY(row+0x0), CHECKSUM_ENTRY(row+0x1), CHECKSUM_ENTRY(row+0x2), CHECKSUM_ENTRY(row+0x3), \
+	CHECKSUM_ENTRY(row+0x4), CHECKSUM_ENTRY(row+0x5), CHECKSUM_ENTRY(row+0x6), CHECKSUM_ENTRY(row+0x7), \
+	CHECKSUM_ENTRY(row+0x8), CHECKSUM_ENTRY(row+0x9), CHECKSUM_ENTRY(row+0xA), CHECKSUM_ENTRY(row+0xB), \
+	CHECKSUM_ENTRY(row+0xC), CHECKSUM_ENTRY(row+0xD), CHECKSUM_ENTRY(row+0xE), CHECKSUM_ENTRY(row+0xF)
+
+static const uint16_t checksumTable[256] PROGMEM = {
+	CHECKSUM_ROW(0x00), CHECKSUM_ROW(0x10), CHECKSUM_ROW(0x20), CHECKSUM_ROW(0x30),
+	CHECKSUM_ROW(0x40), CHECKSUM_ROW(0x50), CHECKSUM_ROW(0x60), CHECKSUM_ROW(0x70),
+	CHECKSUM_ROW(0x80), CHECKSUM_ROW(0x90), CHECKSUM_ROW(0xA0), CHECKSUM_ROW(0xB0),
+	CHECKSUM_ROW(0xC0), CHECKSUM_ROW(0xD0), CHECKSUM_ROW(0xE0), CHECKSUM_ROW(0xF0)
+};
+
+//rates a SETUP_REQUEST may switch to, by code
+static const uint32_t baudRates[BAUD_RATES] PROGMEM = {
+	9600, 19200, 38400, 57600, 115200, 250000, 500000, 1000000
+};
+
+static inline uint16_t updateChecksum(uint16_t checksum, byte data) {
+	return (checksum << 8) ^ pgm_read_word(checksumTable+((checksum >> 8) ^ data));
+}
+
 AdvancedSerialClass::AdvancedSerialClass() {
 	this->bufferCondition = READING_STX;
 	this->bufferPosition = 0;
-	this->message = (AdvancedSerialMessage*) &this->messageBuffer;
-	this->message->payload = (byte*)this->message+sizeof(AdvancedSerialMessage);
+	this->bufferEscaped = false;
+	this->bufferChecksum = CHECKSUM_INITIAL;
+	this->queueHead = 0;
+	this->queueCount = 0;
+	for (byte i = 0; i < RX_QUEUE_SIZE; i++)
+		this->messages[i].payload = this->messageBuffer[i];
+#ifdef SLIDING_WINDOW
+	for (byte i = 0; i < TX_WINDOW_SIZE; i++)
+		this->windowMessages[i].payload = this->windowBuffer[i];
+#endif
+	memset(this->lanes, 0, sizeof(this->lanes));
+	this->lanes[PRIORITY_NORMAL].buffer = this->transmitBuffer;
+	this->lanes[PRIORITY_NORMAL].capacity = TX_BUFFER_SIZE;
+	this->transmitPending = 0;
+#ifdef URGENT_LANE
+	this->lanes[PRIORITY_URGENT].buffer = this->urgentBuffer;
+	this->lanes[PRIORITY_URGENT].capacity = URGENT_BUFFER_SIZE;
+	this->encoding = this->lanes+PRIORITY_NORMAL;
+	this->draining = this->lanes+PRIORITY_NORMAL;
+	this->drainRemaining = 0;
+	this->urgentCount = 0;
+#endif
+	this->assemblyBuffer = NULL;
+	this->handlerCount = 0;
+#ifdef COMPRESSION
+	this->compressionCount = 0;
+#endif
+	this->baudInitial = 0;
+	this->baudCurrent = 0;
+	this->baudPending = NO_BAUD;
+	this->resetStatistics();
+#ifdef DENSE_HANDLER_TABLE
+	memset(this->handlers, 0, sizeof(this->handlers));
+#endif
+	this->frame.payload = NULL;
+	this->message = &this->frame;
+	this->setOptions(0);
+}
+
+void AdvancedSerialClass::setOptions(byte options) {
+	this->options = options;
+	this->headerSize = MESSAGE_HEADER_SIZE + ((options & OPTION_WINDOW) ? SEQUENCE_SIZE : 0);
+
+	//both ends restart numbering from zero, frames still in flight are dropped
+	this->receiveSequence = 0;
+	this->receiveBitmap = 0;
+#ifdef SLIDING_WINDOW
+	this->windowHead = 0;
+	this->windowCount = 0;
+	this->windowSequence = 0;
+	this->windowAcknowledged = 0;
+	this->windowLimit = 1;
+#endif
+
+	//a bulk transfer cannot span the switch
+	this->assemblyIndex = NO_FRAGMENT;
+	this->bulkIndex = 0;
+	this->bulkCount = 0;
+
+#ifdef COMPRESSION
+	//the host starts without references, the next compressed frames are keyframes
+	for (byte i = 0; i < this->compressionCount; i++)
+		this->compressions[i].keyframeCountdown = 0;
+#endif
+}
+
+void AdvancedSerialClass::begin(unsigned long baud) {
+	//only a port opened here may switch rates, the fallback needs to know where it started
+	Serial.begin(baud);
+	this->baudInitial = baud;
+	this->baudCurrent = baud;
+	this->baudPending = NO_BAUD;
 }
 
 void AdvancedSerialClass::setReceiver(void (*onReceive)(AdvancedSerialMessage* Message)) {
 	this->onReceive = onReceive;
 }
 
-void AdvancedSerialClass::send(byte type, byte id, byte size, byte* payload) {
-	if (size >= 0 && size <= MESSAGE_MAX_PAYLOAD_SIZE) {
-		Serial.write((byte)DELIMITER_STX);
-		Serial.write(type);
-		Serial.write(id);
-		Serial.write(size);
-		if (size > 0) Serial.write(payload, size);
-		Serial.write((byte)DELIMITER_ETX);
+bool AdvancedSerialClass::setHandler(byte id, void (*onReceive)(AdvancedSerialMessage* Message), byte size) {
+	AdvancedSerialHandler* handler = this->findHandler(id);
+
+#ifdef DENSE_HANDLER_TABLE
+	if (handler->onReceive == NULL && onReceive != NULL)
+		this->handlerCount++;
+	else if (handler->onReceive != NULL && onReceive == NULL)
+		this->handlerCount--;
+#else
+	byte position;
+
+	if (onReceive == NULL) {
+		//a NULL handler removes the entry
+		if (handler != NULL) {
+			position = handler-this->handlers;
+			memmove(handler, handler+1, (this->handlerCount-position-1)*sizeof(AdvancedSerialHandler));
+			this->handlerCount--;
+		}
+		return true;
+	}
+
+	if (handler == NULL) {
+		if (this->handlerCount >= MAX_HANDLERS)
+			return false;
+
+		//keep the table sorted by id
+		position = this->handlerCount;
+		while (position > 0 && this->handlers[position-1].id > id) {
+			this->handlers[position] = this->handlers[position-1];
+			position--;
+		}
+		handler = this->handlers+position;
+		handler->id = id;
+		this->handlerCount++;
 	}
+#endif
+
+	handler->size = size;
+	handler->onReceive = onReceive;
+	return true;
 }
 
-void AdvancedSerialClass::send(byte id, byte size, byte* payload) {
-	this->send(MESSAGE, id, size, payload);
+AdvancedSerialHandler* AdvancedSerialClass::findHandler(byte id) {
+#ifdef DENSE_HANDLER_TABLE
+	return this->handlers+id;
+#else
+	byte low = 0;
+	byte high = this->handlerCount;
+	byte middle;
+
+	while (low < high) {
+		middle = (low+high) >> 1;
+		if (this->handlers[middle].id < id)
+			low = middle+1;
+		else
+			high = middle;
+	}
+	if (low < this->handlerCount && this->handlers[low].id == id)
+		return this->handlers+low;
+	return NULL;
+#endif
 }
 
-void AdvancedSerialClass::loop() {
-	while(Serial.available() > 0) {
-		switch(bufferCondition) {
-			case READING_STX:
-				if ( Serial.read() == DELIMITER_STX) {
-					this->bufferCondition = READING_HEADER;
-				}
-				break;
+void AdvancedSerialClass::dispatch(AdvancedSerialMessage* message) {
+	AdvancedSerialHandler* handler = this->findHandler(message->id);
 
-			case READING_HEADER:
-				this->messageBuffer[this->bufferPosition] = Serial.read();
-				this->bufferPosition++;
-				if ( this->bufferPosition == MESSAGE_HEADER_SIZE ) {
-					if (this->message->size == 0) {
-						//payload is empty
-						this->bufferCondition = READING_ETX;
-					} else if (this->message->size > 0 && this->message->size <= MESSAGE_MAX_PAYLOAD_SIZE) {
-						//read
-						this->bufferPosition += sizeof(this->message->payload);
-						this->bufferCondition = READING_PAYLOAD;
-					} else {
-						//avoid wrong sized messages
-						this->bufferCondition = READING_STX;
-					}
-				}
+	if (handler == NULL || handler->onReceive == NULL) {
+		//ids without a handler go to the general receiver
+		if (this->onReceive != NULL)
+			this->onReceive(message);
+		return;
+	}
+
+	//wrong sized payloads never reach the handler
+	if (handler->size == ANY_SIZE || handler->size == message->size)
+		handler->onReceive(message);
+}
+
+void AdvancedSerialClass::setBulkReceiver(byte* buffer, unsigned int capacity, void (*onBulkReceive)(byte id, byte* data, unsigned int size)) {
+	this->assemblyBuffer = buffer;
+	this->assemblyCapacity = capacity;
+	this->assemblyIndex = NO_FRAGMENT;
+	this->onBulkReceive = onBulkReceive;
+}
+
+static inline bool serialIdle() {
+	//the last byte written has left the shift register
+#if defined(UCSR0A)
+	return (UCSR0A & _BV(TXC0)) != 0;
+#elif defined(UCSRA)
+	return (UCSRA & _BV(TXC)) != 0;
+#else
+	Serial.flush();
+	return true;
+#endif
+}
+
+static inline void serialWriting() {
+	//cleared before the bytes go in, so transmit complete cannot be missed once they are out;
+	//a plain write, the error flags in the same register must not be written back
+#if defined(UCSR0A)
+	UCSR0A = _BV(TXC0);
+#elif defined(UCSRA)
+	UCSRA = _BV(TXC);
+#endif
+}
+
+static inline byte serialWritable() {
+	//bytes the UART takes right now without Serial.write() waiting
+#if defined(UCSR0A)
+	return (UCSR0A & _BV(UDRE0)) ? 1 : 0;
+#elif defined(UCSRA)
+	return (UCSRA & _BV(UDRE)) ? 1 : 0;
+#else
+	return Serial.availableForWrite();
+#endif
+}
+
+void AdvancedSerialClass::push(byte data) {
+#ifdef URGENT_LANE
+	AdvancedSerialLane* lane = this->encoding;
+#else
+	AdvancedSerialLane* lane = this->lanes;
+#endif
+	unsigned int position;
+
+	//bytes of the frame being encoded stay pending until it fits completely
+	if (lane->count+this->transmitPending < lane->capacity) {
+		position = lane->tail+this->transmitPending;
+		if (position >= lane->capacity) position -= lane->capacity;
+		lane->buffer[position] = data;
+	}
+	this->transmitPending++;
+}
+
+static inline byte pop(AdvancedSerialLane* lane) {
+	byte data = lane->buffer[lane->head];
+
+	if (++lane->head == lane->capacity) lane->head = 0;
+	lane->count--;
+	return data;
+}
+
+void AdvancedSerialClass::write(byte data) {
+	//with stuffing, delimiters never appear inside a frame
+	if ((this->options & OPTION_STUFFING) &&
+		(data == DELIMITER_STX || data == DELIMITER_ETX || data == DELIMITER_ESC)) {
+		this->push(DELIMITER_ESC);
+		data ^= ESCAPE_MASK;
+	}
+	this->push(data);
+}
+
+void AdvancedSerialClass::writeSpan(byte* data, byte size, uint16_t* checksum) {
+	for (byte i = 0; i < size; i++) {
+		if (this->options & OPTION_CHECKSUM)
+			*checksum = updateChecksum(*checksum, data[i]);
+		this->write(data[i]);
+	}
+}
+
+#ifdef URGENT_LANE
+bool AdvancedSerialClass::isUrgent(byte type, byte id) {
+	//acknowledges keep the host's window moving, never leave them behind bulk data
+	if (type == MESSAGE_ACKNOWLEDGE || type == MESSAGE_NEGATIVE_ACKNOWLEDGE)
+		return true;
+	if (type != MESSAGE && type != COMPRESSED)
+		return false;
+	for (byte i = 0; i < this->urgentCount; i++) {
+		if (this->urgentIds[i] == id)
+			return true;
+	}
+	return false;
+}
+#endif
+
+bool AdvancedSerialClass::transmit(byte type, byte id, byte sequence, byte size, byte* payload) {
+	byte header[MESSAGE_HEADER_SIZE+SEQUENCE_SIZE];
+	uint16_t checksum = CHECKSUM_INITIAL;
+	AdvancedSerialLane* lane = this->lanes;
+#ifdef URGENT_LANE
+	uint16_t stamp;
+	unsigned int length;
+	//control frames and acknowledges are not timed, only data frames pay for millis()
+	bool stamped = (type == MESSAGE || type == FRAGMENT || type == COMPRESSED);
+#endif
+
+	if (size > MESSAGE_MAX_PAYLOAD_SIZE)
+		return false;
+
+	header[0] = type;
+	header[1] = id;
+	header[2] = size;
+	header[3] = sequence;
+
+	this->transmitPending = 0;
+#ifdef URGENT_LANE
+	lane = this->encoding = this->lanes+(this->isUrgent(type, id) ? PRIORITY_URGENT : PRIORITY_NORMAL);
+	this->push(0);
+	this->push(0);
+	if (stamped) {
+		stamp = millis();
+		this->push(stamp >> 8);
+		this->push(stamp & 0xFF);
+	}
+#endif
+	this->push(DELIMITER_STX);
+	this->writeSpan(header, this->headerSize, &checksum);
+	this->writeSpan(payload, size, &checksum);
+	if (this->options & OPTION_CHECKSUM) {
+		this->write(checksum >> 8);
+		this->write(checksum & 0xFF);
+	}
+	this->push(DELIMITER_ETX);
+
+	//queue the frame whole or not at all
+	if (lane->count+this->transmitPending > lane->capacity) {
+		this->transmitPending = 0;
+		this->statistics.transmitStalls++;
+		return false;
+	}
+
+#ifdef URGENT_LANE
+	//the length is only known now, it goes in front of the stamp
+	length = this->transmitPending-LANE_HEADER_SIZE;
+	if (stamped)
+		length = (length-LANE_STAMP_SIZE) | LANE_STAMPED;
+	lane->buffer[lane->tail] = length >> 8;
+	lane->buffer[(lane->tail+1 == lane->capacity) ? 0 : lane->tail+1] = length & 0xFF;
+	if (lane == this->lanes+PRIORITY_URGENT)
+		this->statistics.urgentFramesSent++;
+#endif
+
+	this->statistics.framesSent++;
+	lane->count += this->transmitPending;
+	lane->tail += this->transmitPending;
+	if (lane->tail >= lane->capacity) lane->tail -= lane->capacity;
+	this->transmitPending = 0;
+	return true;
+}
+
+bool AdvancedSerialClass::transmitting() {
+#ifdef URGENT_LANE
+	return this->drainRemaining > 0 || this->lanes[PRIORITY_NORMAL].count > 0 || this->lanes[PRIORITY_URGENT].count > 0;
+#else
+	return this->lanes[PRIORITY_NORMAL].count > 0;
+#endif
+}
+
+#ifdef URGENT_LANE
+void AdvancedSerialClass::drain() {
+	byte writable = serialWritable();
+	AdvancedSerialLane* lane;
+	uint16_t now = 0;
+	uint16_t stamp;
+	uint16_t delay;
+	bool timed = false;
+
+	//hand over only what the UART accepts without blocking
+	if (writable == 0 || !this->transmitting())
+		return;
+
+	serialWriting();
+	while (writable > 0) {
+		if (this->drainRemaining == 0) {
+			//between frames the urgent lane goes first
+			lane = this->lanes+PRIORITY_URGENT;
+			if (lane->count == 0)
+				lane = this->lanes+PRIORITY_NORMAL;
+			if (lane->count == 0)
 				break;
+			this->drainRemaining = pop(lane) << 8;
+			this->drainRemaining |= pop(lane);
+			this->draining = lane;
+			if (!(this->drainRemaining & LANE_STAMPED))
+				continue;
+
+			this->drainRemaining &= ~LANE_STAMPED;
+			stamp = pop(lane) << 8;
+			stamp |= pop(lane);
+			if (!timed) {
+				now = millis();
+				timed = true;
+			}
+			delay = now-stamp;
+			if (lane == this->lanes+PRIORITY_URGENT) {
+				this->statistics.urgentQueueDelay += delay;
+				if (delay > this->statistics.urgentQueueDelayMax) this->statistics.urgentQueueDelayMax = delay;
+			} else {
+				this->statistics.normalQueueDelay += delay;
+				if (delay > this->statistics.normalQueueDelayMax) this->statistics.normalQueueDelayMax = delay;
+			}
+		}
+
+		Serial.write(pop(this->draining));
+		this->drainRemaining--;
+		if (--writable == 0)
+			writable = serialWritable();
+	}
+}
+#else
+void AdvancedSerialClass::drain() {
+	AdvancedSerialLane* lane = this->lanes;
+	byte writable = serialWritable();
+
+	//hand over only what the UART accepts without blocking
+	if (lane->count == 0 || writable == 0)
+		return;
+
+	serialWriting();
+	while (lane->count > 0 && writable > 0) {
+		Serial.write(pop(lane));
+		if (--writable == 0)
+			writable = serialWritable();
+	}
+}
+#endif
+
+void AdvancedSerialClass::send(byte type, byte id, byte size, byte* payload) {
+	this->transmit(type, id, 0, size, payload);
+}
+
+byte AdvancedSerialClass::send(byte id, byte size, byte* payload) {
+#ifdef COMPRESSION
+	AdvancedSerialCompression* channel = this->findCompression(id);
+
+	if (channel != NULL)
+		return this->compress(channel, size, payload);
+#endif
+	return this->queue(MESSAGE, id, size, payload);
+}
+
+bool AdvancedSerialClass::setPriority(byte id, byte priority) {
+#ifndef URGENT_LANE
+	//without the urgent lane every id is already normal
+	return priority == PRIORITY_NORMAL;
+#else
+	for (byte i = 0; i < this->urgentCount; i++) {
+		if (this->urgentIds[i] == id) {
+			if (priority == PRIORITY_NORMAL)
+				this->urgentIds[i] = this->urgentIds[--this->urgentCount];
+			return true;
+		}
+	}
+
+	if (priority == PRIORITY_NORMAL)
+		return true;
+	if (this->urgentCount >= URGENT_IDS)
+		return false;
+	this->urgentIds[this->urgentCount++] = id;
+	return true;
+#endif
+}
+
+bool AdvancedSerialClass::setCompression(byte id, byte keyframeInterval) {
+#ifndef COMPRESSION
+	//without COMPRESSION only turning it off succeeds
+	return keyframeInterval == 0;
+#else
+	AdvancedSerialCompression* channel = this->findCompression(id);
+
+	if (keyframeInterval == 0) {
+		//zero turns compression off for the id
+		if (channel != NULL)
+			*channel = this->compressions[--this->compressionCount];
+		return true;
+	}
+
+	if (channel == NULL) {
+		if (this->compressionCount >= COMPRESSION_CHANNELS)
+			return false;
+		channel = this->compressions+this->compressionCount++;
+		channel->id = id;
+		channel->counter = 0;
+	}
+	channel->keyframeInterval = keyframeInterval;
+	channel->keyframeCountdown = 0;
+	return true;
+#endif
+}
+
+#ifdef COMPRESSION
+
+AdvancedSerialCompression* AdvancedSerialClass::findCompression(byte id) {
+	for (byte i = 0; i < this->compressionCount; i++) {
+		if (this->compressions[i].id == id)
+			return this->compressions+i;
+	}
+	return NULL;
+}
+
+static byte encodeRuns(byte* data, byte size, byte* target) {
+	byte length = 0;
+	byte control = 0;
+	bool literal = false;
+	byte run;
+
+	for (byte i = 0; i < size; ) {
+		//two or more zeros collapse into one control byte, a single one stays literal
+		run = 0;
+		while (i+run < size && run < COMPRESSED_RUN && data[i+run] == 0)
+			run++;
+		if (run > 1) {
+			target[length++] = COMPRESSED_RUN | (run-1);
+			literal = false;
+			i += run;
+			continue;
+		}
+
+		if (!literal || target[control] == COMPRESSED_LITERALS-1) {
+			control = length++;
+			target[control] = 0;
+			literal = true;
+		} else {
+			target[control]++;
+		}
+		target[length++] = data[i++];
+	}
+	return length;
+}
+
+byte AdvancedSerialClass::compress(AdvancedSerialCompression* channel, byte size, byte* payload) {
+	byte encoded[MESSAGE_MAX_PAYLOAD_SIZE];
+	byte delta[COMPRESSED_MAX_SIZE];
+	bool keyframe = (channel->keyframeCountdown == 0 || size != channel->size);
+	byte result;
+
+	if (size > COMPRESSED_MAX_SIZE)
+		return SEND_INVALID_SIZE;
+
+	if (!keyframe) {
+		//unchanged bytes turn into zero runs
+		for (byte i = 0; i < size; i++)
+			delta[i] = payload[i] ^ channel->reference[i];
+		payload = delta;
+	}
+	encoded[0] = (keyframe ? COMPRESSED_KEYFRAME : 0) | (channel->counter & COMPRESSED_COUNTER);
+	result = this->queue(COMPRESSED, channel->id, COMPRESSED_HEADER_SIZE+encodeRuns(payload, size, encoded+COMPRESSED_HEADER_SIZE), encoded);
+
+	//a frame that was not sent must not become the reference
+	if (result == SEND_OK) {
+		if (keyframe) {
+			channel->size = size;
+			channel->keyframeCountdown = channel->keyframeInterval;
+			memcpy(channel->reference, payload, size);
+		} else {
+			for (byte i = 0; i < size; i++)
+				channel->reference[i] ^= delta[i];
+		}
+		channel->counter++;
+		channel->keyframeCountdown--;
+	}
+	return result;
+}
+#endif
+
+byte AdvancedSerialClass::sendBulk(byte id, byte* data, unsigned int size) {
+	unsigned int count = (size+FRAGMENT_DATA_SIZE-1) / FRAGMENT_DATA_SIZE;
+
+	if (this->bulkIndex < this->bulkCount)
+		return SEND_BUSY;
+	if (count > 255)
+		return SEND_INVALID_SIZE;
+
+	//data must stay untouched until bulkPending() returns zero
+	this->bulkId = id;
+	this->bulkData = data;
+	this->bulkSize = size;
+	this->bulkIndex = 0;
+	this->bulkCount = (count > 0) ? count : 1;
+	this->sendFragments();
+	return SEND_OK;
+}
+
+unsigned int AdvancedSerialClass::bulkPending() {
+	if (this->bulkIndex >= this->bulkCount)
+		return 0;
+	return this->bulkSize-this->bulkIndex*FRAGMENT_DATA_SIZE;
+}
+
+void AdvancedSerialClass::sendFragments() {
+	byte fragment[MESSAGE_MAX_PAYLOAD_SIZE];
+	unsigned int offset;
+	byte length;
+
+	//queue as many fragments as the window and buffer take, the rest on a later pass;
+	//with urgent ids around, the last free window slot is left to them
+	while (this->bulkIndex < this->bulkCount) {
+#if defined(URGENT_LANE) && defined(SLIDING_WINDOW)
+		if (this->urgentCount > 0 && (this->options & OPTION_WINDOW) && this->windowLimit > 1 &&
+			this->windowCount+1 >= (this->windowLimit < TX_WINDOW_SIZE ? this->windowLimit : TX_WINDOW_SIZE))
+			return;
+#endif
+
+		offset = this->bulkIndex*FRAGMENT_DATA_SIZE;
+		length = (this->bulkSize-offset > FRAGMENT_DATA_SIZE) ? FRAGMENT_DATA_SIZE : this->bulkSize-offset;
+		fragment[0] = this->bulkIndex;
+		fragment[1] = this->bulkCount;
+		memcpy(fragment+FRAGMENT_HEADER_SIZE, this->bulkData+offset, length);
+
+		if (this->queue(FRAGMENT, this->bulkId, length+FRAGMENT_HEADER_SIZE, fragment) != SEND_OK)
+			return;
+		this->bulkIndex++;
+	}
+}
+
+void AdvancedSerialClass::reassemble(AdvancedSerialMessage* fragment) {
+	byte index, count, length;
+
+	if (this->assemblyBuffer == NULL || fragment->size < FRAGMENT_HEADER_SIZE)
+		return;
+
+	index = fragment->payload[0];
+	count = fragment->payload[1];
+	length = fragment->size-FRAGMENT_HEADER_SIZE;
 
-			case READING_PAYLOAD:
-				this->messageBuffer[this->bufferPosition] = Serial.read();
-				this->bufferPosition++;
-				if ( this->bufferPosition == (this->message->size+sizeof(AdvancedSerialMessage)) ) {
-					this->bufferCondition = READING_ETX;
+	//the link delivers in order, a first fragment always starts over
+	if (index == 0) {
+		this->assemblyIndex = 0;
+		this->assemblySize = 0;
+	}
+	if (index != this->assemblyIndex || index >= count || this->assemblySize+length > this->assemblyCapacity) {
+		//drop the rest of this message
+		this->assemblyIndex = NO_FRAGMENT;
+		return;
+	}
+
+	memcpy(this->assemblyBuffer+this->assemblySize, fragment->payload+FRAGMENT_HEADER_SIZE, length);
+	this->assemblySize += length;
+	this->assemblyIndex++;
+
+	if (this->assemblyIndex == count) {
+		this->assemblyIndex = NO_FRAGMENT;
+		if (this->onBulkReceive != NULL)
+			this->onBulkReceive(fragment->id, this->assemblyBuffer, this->assemblySize);
+	}
+}
+
+byte AdvancedSerialClass::queue(byte type, byte id, byte size, byte* payload) {
+#ifdef SLIDING_WINDOW
+	AdvancedSerialMessage* pending;
+	byte slot;
+#endif
+
+	if (size > MESSAGE_MAX_PAYLOAD_SIZE)
+		return SEND_INVALID_SIZE;
+
+#ifdef SLIDING_WINDOW
+	if (this->options & OPTION_WINDOW) {
+		//keep a copy until the host acknowledges it
+		if (this->windowCount >= TX_WINDOW_SIZE || this->windowCount >= this->windowLimit)
+			return SEND_WINDOW_FULL;
+		if (!this->transmit(type, id, this->windowSequence, size, payload))
+			return SEND_BUFFER_FULL;
+
+		slot = (this->windowHead+this->windowCount) % TX_WINDOW_SIZE;
+		pending = this->windowMessages+slot;
+		pending->type = type;
+		pending->id = id;
+		pending->size = size;
+		pending->sequence = this->windowSequence++;
+		if (size > 0) memcpy(pending->payload, payload, size);
+		this->windowMillis[slot] = millis();
+		this->windowCount++;
+
+		this->drain();
+		return SEND_OK;
+	}
+#endif
+
+	if (!this->transmit(type, id, 0, size, payload))
+		return SEND_BUFFER_FULL;
+	this->drain();
+	return SEND_OK;
+}
+
+void AdvancedSerialClass::acknowledge(byte type) {
+	byte state[2];
+
+	this->statistics.acknowledgesSent++;
+	if (this->options & OPTION_WINDOW) {
+		//next expected sequence, frames held beyond it, and free slots
+		state[0] = this->receiveBitmap >> 1;
+		state[1] = RX_QUEUE_SIZE-this->queueCount;
+		if (state[1] > MAX_WINDOW_SIZE) state[1] = MAX_WINDOW_SIZE;
+		this->transmit(type, this->receiveSequence, 0, 2, state);
+	} else {
+		this->transmit(type, 0, 0, 0, NULL);
+	}
+}
+
+#ifdef SLIDING_WINDOW
+void AdvancedSerialClass::acknowledged(byte type) {
+	byte done;
+
+	if (this->windowCount == 0)
+		return;
+
+	//everything before the cumulative sequence is delivered
+	done = this->message->id-this->windowMessages[this->windowHead].sequence;
+	if (done > this->windowCount)
+		return;
+	this->windowHead = (this->windowHead+done) % TX_WINDOW_SIZE;
+	this->windowCount -= done;
+	this->windowAcknowledged >>= done;
+
+	if (this->message->payload != NULL) {
+		if (this->message->size > 0)
+			this->windowAcknowledged |= (this->message->payload[0] << 1) & ((1 << this->windowCount)-1);
+		if (this->message->size > 1)
+			this->windowLimit = this->message->payload[1];
+	}
+
+	//a rejected frame is resent at once instead of waiting for the timeout
+	if (type == MESSAGE_NEGATIVE_ACKNOWLEDGE && this->windowCount > 0 && (this->windowAcknowledged & 1) == 0)
+		this->windowMillis[this->windowHead] = millis()-RETRANSMIT_TIMEOUT;
+}
+
+void AdvancedSerialClass::retransmit() {
+	AdvancedSerialMessage* pending;
+	unsigned long now;
+	byte slot;
+
+	if (this->windowCount == 0)
+		return;
+
+	//resend only the frames the host has not acknowledged yet
+	now = millis();
+	for (byte i = 0; i < this->windowCount; i++) {
+		if (this->windowAcknowledged & (1 << i))
+			continue;
+
+		slot = (this->windowHead+i) % TX_WINDOW_SIZE;
+		if (now-this->windowMillis[slot] >= RETRANSMIT_TIMEOUT) {
+			//with the buffer full, try again on the next pass
+			pending = this->windowMessages+slot;
+			if (!this->transmit(pending->type, pending->id, pending->sequence, pending->size, pending->payload))
+				return;
+			this->windowMillis[slot] = now;
+			this->statistics.retransmits++;
+		}
+	}
+}
+#endif
+
+AdvancedSerialMessage* AdvancedSerialClass::receive() {
+	//fragments are collected here and never handed out one by one
+	while (this->queueCount > 0 && this->messages[this->queueHead].type == FRAGMENT) {
+		this->reassemble(this->messages+this->queueHead);
+		this->release();
+	}
+
+	//oldest queued message, its payload stays valid until release()
+	if (this->queueCount > 0)
+		return this->messages+this->queueHead;
+	return NULL;
+}
+
+void AdvancedSerialClass::release() {
+	if (this->queueCount > 0) {
+		this->queueHead = (this->queueHead+1) % RX_QUEUE_SIZE;
+		this->queueCount--;
+
+		//a host stalled on a closed window needs to hear it opened again
+		if ((this->options & OPTION_WINDOW) && this->queueCount == RX_QUEUE_SIZE-1)
+			this->acknowledge(MESSAGE_ACKNOWLEDGE);
+	}
+}
+
+byte AdvancedSerialClass::available() {
+	return this->queueCount;
+}
+
+byte AdvancedSerialClass::getOptions() {
+	return this->options;
+}
+
+unsigned long AdvancedSerialClass::getBaud() {
+	return this->baudCurrent;
+}
+
+AdvancedSerialStatistics* AdvancedSerialClass::getStatistics() {
+	return &this->statistics;
+}
+
+void AdvancedSerialClass::resetStatistics() {
+	memset(&this->statistics, 0, sizeof(this->statistics));
+	this->baudErrors = 0;
+}
+
+unsigned long AdvancedSerialClass::linkErrors() {
+	return this->statistics.sizeRejects+this->statistics.delimiterErrors+this->statistics.checksumErrors+this->statistics.bytesDiscarded;
+}
+
+void AdvancedSerialClass::confirmBaud() {
+	//a good frame at a switched rate proves the host followed
+	if (this->baudCurrent != this->baudInitial) {
+		this->baudConfirmed = true;
+		this->baudMillis = millis();
+		this->baudErrors = this->linkErrors();
+	}
+}
+
+void AdvancedSerialClass::switchBaud() {
+	if (this->baudPending != NO_BAUD) {
+		//the response still goes out at the old rate, switch once its last bit has left
+		if (this->transmitting()) {
+			this->baudMillis = millis();
+			return;
+		}
+		//the UART holds two bytes at most, do not wait on a transmit complete that never comes
+		if (!serialIdle() && millis()-this->baudMillis < BAUD_IDLE_TIMEOUT)
+			return;
+		this->baudCurrent = pgm_read_dword(baudRates+this->baudPending);
+		this->baudPending = NO_BAUD;
+		this->baudConfirmed = false;
+		this->baudMillis = millis();
+		this->baudErrors = this->linkErrors();
+		Serial.begin(this->baudCurrent);
+		return;
+	}
+
+	//a host that never followed, or lost track of the rate, finds the board where it started
+	if (millis()-this->baudMillis >= BAUD_FALLBACK_TIMEOUT &&
+		(!this->baudConfirmed || this->linkErrors()-this->baudErrors >= BAUD_FALLBACK_ERRORS)) {
+		this->baudCurrent = this->baudInitial;
+		Serial.begin(this->baudCurrent);
+		this->setOptions(0);
+		this->bufferCondition = READING_STX;
+	}
+}
+
+void AdvancedSerialClass::sendStatistics(byte first) {
+	byte response[STATISTICS_COUNT*4];
+	unsigned long* counters = (unsigned long*)&this->statistics;
+	unsigned long value;
+	byte count = 0;
+
+	//from the requested counter on, as many as fit in one frame
+	while (first+count < STATISTICS_COUNT && (count+1)*4 <= MESSAGE_MAX_PAYLOAD_SIZE) {
+		value = counters[first+count];
+		response[count*4] = value >> 24;
+		response[count*4+1] = value >> 16;
+		response[count*4+2] = value >> 8;
+		response[count*4+3] = value;
+		count++;
+	}
+	this->send(DEBUG, first, count*4, response);
+}
+
+void AdvancedSerialClass::nextMessage() {
+	//the header is read aside, the frame is placed once its sequence is known
+	this->message = &this->frame;
+	this->frame.sequence = 0;
+	this->bufferPosition = 0;
+	this->bufferEscaped = false;
+	this->bufferChecksum = CHECKSUM_INITIAL;
+	this->bufferCondition = READING_HEADER;
+}
+
+void AdvancedSerialClass::headerReceived() {
+	byte offset;
+
+	if (this->bufferPosition == MESSAGE_HEADER_SIZE && this->frame.type == DISCOVERY_REQUEST && this->frame.size == 0) {
+		//discovery is always a bare frame, so it gets through whatever options are active
+		this->bufferPosition = 0;
+		this->bufferCondition = READING_ETX;
+		return;
+	}
+	if (this->bufferPosition < this->headerSize)
+		return;
+
+	this->bufferPosition = 0;
+	if (this->frame.size > MESSAGE_MAX_PAYLOAD_SIZE) {
+		//avoid wrong sized messages
+		this->statistics.sizeRejects++;
+		this->bufferCondition = READING_STX;
+		return;
+	}
+
+	if (this->frame.type == MESSAGE || this->frame.type == FRAGMENT) {
+		//parse straight into the slot matching its sequence, or throw the frame away
+		offset = this->frame.sequence-this->receiveSequence;
+		if (offset < RX_QUEUE_SIZE-this->queueCount && offset < MAX_WINDOW_SIZE && (this->receiveBitmap & (1 << offset)) == 0) {
+			this->message = this->messages+((this->queueHead+this->queueCount+offset) % RX_QUEUE_SIZE);
+			this->message->type = this->frame.type;
+			this->message->id = this->frame.id;
+			this->message->size = this->frame.size;
+			this->message->sequence = this->frame.sequence;
+		} else {
+			this->frame.payload = NULL;
+		}
+	} else {
+		this->frame.payload = (this->frame.size <= CONTROL_PAYLOAD_SIZE) ? this->controlBuffer : NULL;
+	}
+
+	if (this->frame.size == 0) {
+		//payload is empty
+		this->bufferCondition = (this->options & OPTION_CHECKSUM) ? READING_CHECKSUM : READING_ETX;
+	} else {
+		//read
+		this->bufferCondition = READING_PAYLOAD;
+	}
+}
+
+void AdvancedSerialClass::messageReceived() {
+	byte response[CAPABILITY_SIZE];
+	byte offset;
+
+	this->statistics.framesReceived++;
+	if (this->message->type == DISCOVERY_REQUEST) {
+		//discovery always leaves the link in plain framing, and is answered in it
+		this->confirmBaud();
+		this->setOptions(0);
+		this->baudPending = NO_BAUD;
+		response[0] = PROTOCOL_VERSION;
+		response[1] = MESSAGE_MAX_PAYLOAD_SIZE;
+		response[2] = SUPPORTED_OPTIONS;
+		response[3] = (this->baudInitial != 0) ? SUPPORTED_BAUDS : 0;
+		this->send(DISCOVERY_RESPONSE, 0, CAPABILITY_SIZE, response);
+		return;
+	}
+
+	if ((this->options & OPTION_CHECKSUM) && this->bufferChecksum != 0) {
+		//trailer included, a good frame leaves a zero remainder;
+		//only data frames are answered, a rejected control frame could start a NAK ping-pong
+		this->statistics.checksumErrors++;
+		if (this->message->type == MESSAGE || this->message->type == FRAGMENT || this->message->type == COMPRESSED)
+			this->acknowledge(MESSAGE_NEGATIVE_ACKNOWLEDGE);
+		return;
+	}
+	this->confirmBaud();
+
+	switch (this->message->type) {
+		case SETUP_REQUEST:
+			//answer in the current framing, then switch
+			if (this->message->size > 0 && this->message->payload != NULL) {
+				response[0] = this->message->payload[0] & SUPPORTED_OPTIONS;
+				response[1] = RX_QUEUE_SIZE < MAX_WINDOW_SIZE ? RX_QUEUE_SIZE : MAX_WINDOW_SIZE;
+				response[2] = NO_BAUD;
+				if (this->message->size > 2 && this->message->payload[2] < BAUD_RATES &&
+					(SUPPORTED_BAUDS & (1 << this->message->payload[2])) && this->baudInitial != 0)
+					response[2] = this->message->payload[2];
+				this->send(SETUP_RESPONSE, 0, 3, response);
+				this->setOptions(response[0]);
+#ifdef SLIDING_WINDOW
+				if (this->message->size > 1)
+					this->windowLimit = this->message->payload[1];
+#endif
+				this->baudPending = response[2];
+				this->baudMillis = millis();
+			}
+			break;
+
+		case MESSAGE:
+		case FRAGMENT:
+			if (this->message == &this->frame) {
+				//a frame inside the window that was not held found no free slot, the rest are duplicates
+				offset = this->frame.sequence-this->receiveSequence;
+				if (offset < MAX_WINDOW_SIZE && (this->receiveBitmap & (1 << offset)) == 0)
+					this->statistics.receiveOverruns++;
+
+				//a full queue leaves the frame unacknowledged so the host retransmits it,
+				//with windowing the host still learns what is missing
+				if (this->options & OPTION_WINDOW)
+					this->acknowledge(MESSAGE_ACKNOWLEDGE);
+			} else if (this->options & OPTION_WINDOW) {
+				//deliver in order, holding anything that arrived ahead of a gap
+				this->receiveBitmap |= 1 << (byte)(this->message->sequence-this->receiveSequence);
+				while (this->receiveBitmap & 1) {
+					this->receiveBitmap >>= 1;
+					this->receiveSequence++;
+					this->queueCount++;
 				}
-				break;
+				this->acknowledge(MESSAGE_ACKNOWLEDGE);
+			} else {
+				this->queueCount++;
+				this->acknowledge(MESSAGE_ACKNOWLEDGE);
+			}
+			break;
 
-			case READING_ETX:
-				if ( Serial.read() == DELIMITER_ETX) {
-					if (this->message->type == DISCOVERY_REQUEST) {
-						this->send(DISCOVERY_RESPONSE, 0, 0, NULL);
-					} else if (this->message->type == MESSAGE) {
-						this->send(MESSAGE_ACKNOWLEDGE, 0, 0, NULL);
+		case DEBUG:
+			this->sendStatistics(this->message->id);
+			break;
 
-						if (this->onReceive != NULL)
-							this->onReceive(this->message);
-					}
+		case MESSAGE_ACKNOWLEDGE:
+		case MESSAGE_NEGATIVE_ACKNOWLEDGE:
+			this->statistics.acknowledgesReceived++;
+#ifdef SLIDING_WINDOW
+			if (this->options & OPTION_WINDOW)
+				this->acknowledged(this->message->type);
+#endif
+			break;
+	}
+}
+
+void AdvancedSerialClass::readSpan(byte* target, byte size) {
+	byte data;
+
+	if (this->options & OPTION_CHECKSUM) {
+		while (size-- > 0) {
+			data = Serial.read();
+			this->bufferChecksum = updateChecksum(this->bufferChecksum, data);
+			if (target != NULL) *target++ = data;
+		}
+	} else if (target != NULL) {
+		while (size-- > 0) *target++ = Serial.read();
+	} else {
+		while (size-- > 0) Serial.read();
+	}
+}
+
+void AdvancedSerialClass::storeByte(byte data) {
+	if (this->options & OPTION_CHECKSUM)
+		this->bufferChecksum = updateChecksum(this->bufferChecksum, data);
+
+	switch(this->bufferCondition) {
+		case READING_HEADER:
+			((byte*)&this->frame)[this->bufferPosition] = data;
+			this->bufferPosition++;
+			if ( this->bufferPosition >= MESSAGE_HEADER_SIZE )
+				this->headerReceived();
+			break;
+
+		case READING_PAYLOAD:
+			if (this->message->payload != NULL)
+				this->message->payload[this->bufferPosition] = data;
+			this->bufferPosition++;
+			if ( this->bufferPosition == this->message->size ) {
+				this->bufferPosition = 0;
+				this->bufferCondition = (this->options & OPTION_CHECKSUM) ? READING_CHECKSUM : READING_ETX;
+			}
+			break;
+
+		case READING_CHECKSUM:
+			this->bufferPosition++;
+			if ( this->bufferPosition == CHECKSUM_SIZE )
+				this->bufferCondition = READING_ETX;
+			break;
+
+		case READING_ETX:
+			//frame is longer than its header says
+			this->statistics.delimiterErrors++;
+			this->bufferCondition = READING_STX;
+			break;
+	}
+}
+
+void AdvancedSerialClass::parse() {
+	byte framing;
+
+	//a SETUP_REQUEST or DISCOVERY_REQUEST may switch framing halfway through the buffered bytes
+	do {
+		framing = this->options & OPTION_STUFFING;
+		if (framing)
+			this->parseStuffed();
+		else
+			this->parseSpans();
+	} while ((this->options & OPTION_STUFFING) != framing);
+}
+
+void AdvancedSerialClass::parseStuffed() {
+	short pending;
+	byte data;
+
+	//delimiters are unambiguous here, so any STX restarts and any ETX ends a frame
+	while ((pending = Serial.available()) > 0) {
+		while (pending-- > 0) {
+			data = Serial.read();
+
+			if (data == DELIMITER_STX) {
+				//a frame still open was cut short
+				if (this->bufferCondition != READING_STX)
+					this->statistics.delimiterErrors++;
+				this->nextMessage();
+			} else if (this->bufferCondition == READING_STX) {
+				//noise between frames
+				this->statistics.bytesDiscarded++;
+			} else if (data == DELIMITER_ETX) {
+				if (this->bufferCondition == READING_ETX && !this->bufferEscaped) {
+					this->bufferCondition = READING_STX;
+					this->messageReceived();
+					if ((this->options & OPTION_STUFFING) == 0) return;
+				} else {
+					this->statistics.delimiterErrors++;
 				}
 				this->bufferCondition = READING_STX;
-				this->bufferPosition = 0;
-				break;
+			} else if (data == DELIMITER_ESC) {
+				this->bufferEscaped = true;
+			} else {
+				if (this->bufferEscaped) {
+					data ^= ESCAPE_MASK;
+					this->bufferEscaped = false;
+				}
+				this->storeByte(data);
+			}
 		}
+	}
+}
 
+void AdvancedSerialClass::parseSpans() {
+	short pending;
+	byte span;
+
+	//consume every byte the port holds, one state-sized span at a time
+	while ((pending = Serial.available()) > 0) {
+		while (pending > 0) {
+			switch(this->bufferCondition) {
+				case READING_STX:
+					//skip noise up to the next frame start
+					while (pending > 0) {
+						pending--;
+						if (Serial.read() == DELIMITER_STX) {
+							this->nextMessage();
+							break;
+						}
+						this->statistics.bytesDiscarded++;
+					}
+					break;
+
+				case READING_HEADER:
+					//stop after the fixed header, discovery frames never carry a sequence
+					span = ((this->bufferPosition < MESSAGE_HEADER_SIZE) ? MESSAGE_HEADER_SIZE : this->headerSize)-this->bufferPosition;
+					if (span > pending) span = pending;
+					this->readSpan((byte*)&this->frame+this->bufferPosition, span);
+					this->bufferPosition += span;
+					pending -= span;
+					if ( this->bufferPosition >= MESSAGE_HEADER_SIZE )
+						this->headerReceived();
+					break;
+
+				case READING_PAYLOAD:
+					span = this->message->size-this->bufferPosition;
+					if (span > pending) span = pending;
+					this->readSpan(this->message->payload != NULL ? this->message->payload+this->bufferPosition : NULL, span);
+					this->bufferPosition += span;
+					pending -= span;
+					if ( this->bufferPosition == this->message->size ) {
+						this->bufferPosition = 0;
+						this->bufferCondition = (this->options & OPTION_CHECKSUM) ? READING_CHECKSUM : READING_ETX;
+					}
+					break;
+
+				case READING_CHECKSUM:
+					span = CHECKSUM_SIZE-this->bufferPosition;
+					if (span > pending) span = pending;
+					this->readSpan(NULL, span);
+					this->bufferPosition += span;
+					pending -= span;
+					if ( this->bufferPosition == CHECKSUM_SIZE )
+						this->bufferCondition = READING_ETX;
+					break;
+
+				case READING_ETX:
+					pending--;
+					this->bufferCondition = READING_STX;
+					this->bufferPosition = 0;
+					if ( Serial.read() == DELIMITER_ETX) {
+						this->messageReceived();
+						if (this->options & OPTION_STUFFING) return;
+					} else {
+						this->statistics.delimiterErrors++;
+					}
+					break;
+			}
+		}
+	}
+}
+
+void AdvancedSerialClass::loop() {
+	AdvancedSerialMessage* received;
+
+	this->parse();
+	//the transmit side stays off the receive path while it has nothing to do
+#ifdef SLIDING_WINDOW
+	if (this->windowCount > 0)
+		this->retransmit();
+#endif
+	if (this->bulkIndex < this->bulkCount)
+		this->sendFragments();
+	if (this->transmitting())
+		this->drain();
+	if (this->baudPending != NO_BAUD || this->baudCurrent != this->baudInitial)
+		this->switchBaud();
+
+	//callbacks run after the port is drained, and the port is drained again between callbacks;
+	//without message callbacks, messages stay queued for receive() once fragments are collected
+	for (byte i = 0; i < RX_QUEUE_SIZE; i++) {
+		received = this->receive();
+		if (received == NULL || (this->onReceive == NULL && this->handlerCount == 0))
+			break;
+		this->dispatch(received);
+		this->release();
+		this->parse();
 	}
+
+	if (this->transmitting())
+		this->drain();
 }
 
 AdvancedSerialClass AdvancedSerial;
\ No newline at end of file
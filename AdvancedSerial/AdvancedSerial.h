@@ -30,21 +30,161 @@
 #define AdvancedSerial_h
 
 #define MESSAGE_HEADER_SIZE 3
+#define SEQUENCE_SIZE 1
+#define CONTROL_PAYLOAD_SIZE 4
+
+//the sizes and switches below are read when AdvancedSerial.cpp is compiled, which the
+//Arduino IDE does apart from the sketch: a #define in the sketch never reaches the
+//library and would leave the sketch checking against other sizes, so change them here
+
+//largest payload of a single frame, both ends must agree on it
+#ifndef MESSAGE_MAX_PAYLOAD_SIZE
 #define MESSAGE_MAX_PAYLOAD_SIZE 32
+#endif
+#if MESSAGE_MAX_PAYLOAD_SIZE < 8 || MESSAGE_MAX_PAYLOAD_SIZE > 255
+#error MESSAGE_MAX_PAYLOAD_SIZE must be between 8 and 255
+#endif
+
+//bulk messages travel as numbered fragments: index, count, data
+#define FRAGMENT_HEADER_SIZE 2
+#define FRAGMENT_DATA_SIZE (MESSAGE_MAX_PAYLOAD_SIZE-FRAGMENT_HEADER_SIZE)
+#define NO_FRAGMENT 0xFF
+
+//messages sent through a compressed id go out as COMPRESSED frames: a header byte
+//with the keyframe flag and a 7 bit counter, then control bytes, 0x80|n standing for
+//n+1 zero bytes and n below 0x80 for the n+1 literal bytes after it. keyframes encode
+//the payload itself, the frames between them its XOR with the previous payload.
+//uncomment COMPRESSION to keep that state for COMPRESSION_CHANNELS ids
+//#define COMPRESSION
+#ifndef COMPRESSION_CHANNELS
+#define COMPRESSION_CHANNELS 2
+#endif
+#define COMPRESSED_HEADER_SIZE 1
+#define COMPRESSED_KEYFRAME 0x80
+#define COMPRESSED_COUNTER 0x7F
+#define COMPRESSED_RUN 0x80
+#define COMPRESSED_LITERALS 0x80
+//largest payload whose worst case encoding still fits in one frame
+#define COMPRESSED_MAX_SIZE (MESSAGE_MAX_PAYLOAD_SIZE-COMPRESSED_HEADER_SIZE-2)
+
+//number of received frames held until released by the application
+#ifndef RX_QUEUE_SIZE
+#define RX_QUEUE_SIZE 4
+#endif
+
+//encoded bytes waiting for the UART, must hold a fully stuffed frame and its lane header
+#ifndef TX_BUFFER_SIZE
+#define TX_BUFFER_SIZE (2*MESSAGE_MAX_PAYLOAD_SIZE+32)
+#endif
+
+//uncomment to give frames of urgent ids and acknowledges a lane of their own, sent at
+//the next frame boundary ahead of everything queued before them; it also keeps the
+//queue delay statistics
+//#define URGENT_LANE
+
+#define PRIORITY_NORMAL 0x00
+#define PRIORITY_URGENT 0x01
+#ifdef URGENT_LANE
+#ifndef URGENT_BUFFER_SIZE
+#define URGENT_BUFFER_SIZE (2*MESSAGE_MAX_PAYLOAD_SIZE+32)
+#endif
+#ifndef URGENT_IDS
+#define URGENT_IDS 4
+#endif
+#define PRIORITY_CLASSES 2
+//queued frames are preceded by their length; data frames also carry the millis()
+//they were queued at, flagged in the top bit of the length
+#define LANE_HEADER_SIZE 2
+#define LANE_STAMP_SIZE 2
+#define LANE_STAMPED 0x8000
+#else
+#define PRIORITY_CLASSES 1
+#endif
+
+//per id handlers live in a sorted table searched by bisection,
+//uncomment DENSE_HANDLER_TABLE to index a 256 entry table by id instead
+//#define DENSE_HANDLER_TABLE
+#ifndef MAX_HANDLERS
+#define MAX_HANDLERS 16
+#endif
+#define ANY_SIZE 0xFF
+
+//width of the selective acknowledge bitmap
+#define MAX_WINDOW_SIZE 8
+#define RETRANSMIT_TIMEOUT 250
+
+//uncomment SLIDING_WINDOW to offer OPTION_WINDOW, keeping the last TX_WINDOW_SIZE sent
+//frames for retransmission; without it setup never grants windowing
+//#define SLIDING_WINDOW
+#ifdef SLIDING_WINDOW
+#ifndef TX_WINDOW_SIZE
+#define TX_WINDOW_SIZE 4
+#endif
+#if TX_WINDOW_SIZE < 1 || TX_WINDOW_SIZE > MAX_WINDOW_SIZE
+#error TX_WINDOW_SIZE must be between 1 and MAX_WINDOW_SIZE
+#endif
+#endif
 
 #define READING_STX 0x01
 #define READING_HEADER 0x02
 #define READING_PAYLOAD 0x03
 #define READING_ETX 0x04
+#define READING_CHECKSUM 0x05
 
 #define DELIMITER_STX 0x02
 #define DELIMITER_ETX 0x03
+#define DELIMITER_ESC 0x10
+#define ESCAPE_MASK 0x20
+
+#define SEND_OK 0x00
+#define SEND_INVALID_SIZE 0x01
+#define SEND_WINDOW_FULL 0x02
+#define SEND_BUFFER_FULL 0x03
+#define SEND_BUSY 0x04
 
 #define DEBUG 0x01
 #define MESSAGE 0x02
 #define MESSAGE_ACKNOWLEDGE 0x03
 #define DISCOVERY_REQUEST 0x04
 #define DISCOVERY_RESPONSE 0x05
+#define SETUP_REQUEST 0x06
+#define SETUP_RESPONSE 0x07
+#define MESSAGE_NEGATIVE_ACKNOWLEDGE 0x08
+#define FRAGMENT 0x09
+#define COMPRESSED 0x0A
+
+//link options negotiated with SETUP_REQUEST, reset to none by DISCOVERY_REQUEST
+#define OPTION_STUFFING 0x01
+#define OPTION_CHECKSUM 0x02
+#define OPTION_WINDOW 0x04
+#ifdef SLIDING_WINDOW
+#define SUPPORTED_OPTIONS (OPTION_STUFFING|OPTION_CHECKSUM|OPTION_WINDOW)
+#else
+#define SUPPORTED_OPTIONS (OPTION_STUFFING|OPTION_CHECKSUM)
+#endif
+
+//DISCOVERY_RESPONSE describes the device: protocol version, largest payload, supported
+//options and a bitmap of the rates it can switch to, bit n standing for the n-th of
+//9600, 19200, 38400, 57600, 115200, 250000, 500000 and 1000000 baud
+#define PROTOCOL_VERSION 0x01
+#define CAPABILITY_SIZE 4
+#define BAUD_RATES 8
+#ifndef SUPPORTED_BAUDS
+#define SUPPORTED_BAUDS 0xFF
+#endif
+
+//a third SETUP_REQUEST byte asks for one of those rates and is echoed when accepted;
+//the device switches once the response is out, and returns to the begin() rate when
+//no good frame confirms the new one, or only errors arrive for that long
+#define NO_BAUD 0xFF
+#define BAUD_FALLBACK_TIMEOUT 1000
+#define BAUD_FALLBACK_ERRORS 4
+#define BAUD_IDLE_TIMEOUT 4
+
+//CRC-16/CCITT trailer, high byte first, over type, id, size and payload
+#define CHECKSUM_SIZE 2
+#define CHECKSUM_POLYNOMIAL 0x1021
+#define CHECKSUM_INITIAL 0xFFFF
 
 #include <stdlib.h>
 #include "WProgram.h"
@@ -53,27 +193,227 @@ struct AdvancedSerialMessage {
 	byte type;
 	byte id;
 	byte size;
+	byte sequence;
 	byte* payload;
 };
 
+//link counters, answered to a DEBUG request in this order, high byte first;
+//they wrap around silently. queue delays are milliseconds from send() to the wire,
+//the urgent and queue delay counters stay zero without URGENT_LANE
+#define STATISTICS_COUNT 16
+
+struct AdvancedSerialStatistics {
+	unsigned long framesReceived;
+	unsigned long framesSent;
+	unsigned long acknowledgesSent;
+	unsigned long acknowledgesReceived;
+	unsigned long sizeRejects;
+	unsigned long delimiterErrors;
+	unsigned long checksumErrors;
+	unsigned long bytesDiscarded;
+	unsigned long receiveOverruns;
+	unsigned long transmitStalls;
+	unsigned long retransmits;
+	unsigned long urgentFramesSent;
+	unsigned long normalQueueDelay;
+	unsigned long urgentQueueDelay;
+	unsigned long normalQueueDelayMax;
+	unsigned long urgentQueueDelayMax;
+};
+
+struct AdvancedSerialLane {
+	byte* buffer;
+	unsigned int capacity;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int count;
+};
+
+#ifdef COMPRESSION
+//last payload sent through a compressed id, the host keeps the same copy
+struct AdvancedSerialCompression {
+	byte id;
+	byte size;
+	byte counter;
+	byte keyframeInterval;
+	byte keyframeCountdown;
+	byte reference[COMPRESSED_MAX_SIZE];
+};
+#endif
+
+struct AdvancedSerialHandler {
+#ifndef DENSE_HANDLER_TABLE
+	byte id;
+#endif
+	byte size;
+	void (*onReceive)(AdvancedSerialMessage* Message);
+};
+
+//typed payloads are sent and read in place as they sit in memory, so they must be
+//plain structs declared with __attribute__((packed)); multi-byte fields go out
+//little-endian, as the AVR stores them. a failed check names itself in the error
+template<bool> struct PayloadMustBeTriviallyCopyable;
+template<> struct PayloadMustBeTriviallyCopyable<true> { static void verify() {} };
+template<bool> struct PayloadMustBePacked;
+template<> struct PayloadMustBePacked<true> { static void verify() {} };
+template<bool> struct PayloadMustFitInOneFrame;
+template<> struct PayloadMustFitInOneFrame<true> { static void verify() {} };
+
+template<class T> inline void verifyPayload() {
+	PayloadMustBeTriviallyCopyable<__has_trivial_copy(T)>::verify();
+	PayloadMustBePacked<__alignof__(T) == 1>::verify();
+	PayloadMustFitInOneFrame<sizeof(T) <= MESSAGE_MAX_PAYLOAD_SIZE>::verify();
+}
+
+//decodes straight from the receive slot, the size was checked by the handler table
+template<class T, void (*onReceive)(const T& value)> void receivePayload(AdvancedSerialMessage* message) {
+	onReceive(*(const T*)message->payload);
+}
+
 class AdvancedSerialClass
 {
   public:
     AdvancedSerialClass();
+	void begin(unsigned long baud);
 	void setReceiver(void (*onReceive)(AdvancedSerialMessage* Message));
-	void send(byte id, byte size, byte* payload);
+	bool setHandler(byte id, void (*onReceive)(AdvancedSerialMessage* Message), byte size = ANY_SIZE);
+	template<class T, void (*onReceive)(const T& value)> bool setHandler(byte id);
+	void setBulkReceiver(byte* buffer, unsigned int capacity, void (*onBulkReceive)(byte id, byte* data, unsigned int size));
+	byte send(byte id, byte size, byte* payload);
+	template<class T> byte send(byte id, const T& value);
+	bool setCompression(byte id, byte keyframeInterval);
+	bool setPriority(byte id, byte priority);
+	byte sendBulk(byte id, byte* data, unsigned int size);
+	unsigned int bulkPending();
+	AdvancedSerialMessage* receive();
+	void release();
+	byte available();
+	byte getOptions();
+	unsigned long getBaud();
+	AdvancedSerialStatistics* getStatistics();
+	void resetStatistics();
 	void loop();
 
   private:
+	byte options;
+	byte headerSize;
 	byte bufferCondition;
 	byte bufferPosition;
-	byte messageBuffer[sizeof(AdvancedSerialMessage)+MESSAGE_MAX_PAYLOAD_SIZE];
+	bool bufferEscaped;
+	uint16_t bufferChecksum;
+	byte queueHead;
+	byte queueCount;
+	byte receiveSequence;
+	byte receiveBitmap;
+#ifdef SLIDING_WINDOW
+	byte windowHead;
+	byte windowCount;
+	byte windowSequence;
+	byte windowAcknowledged;
+	byte windowLimit;
+#endif
+	AdvancedSerialLane lanes[PRIORITY_CLASSES];
+#ifdef URGENT_LANE
+	AdvancedSerialLane* encoding;
+	AdvancedSerialLane* draining;
+	unsigned int drainRemaining;
+#endif
+	unsigned int transmitPending;
+	byte assemblyIndex;
+	unsigned int assemblySize;
+	unsigned int assemblyCapacity;
+	byte* assemblyBuffer;
+	byte bulkId;
+	byte bulkIndex;
+	byte bulkCount;
+	unsigned int bulkSize;
+	byte* bulkData;
+	byte transmitBuffer[TX_BUFFER_SIZE];
+#ifdef URGENT_LANE
+	byte urgentBuffer[URGENT_BUFFER_SIZE];
+	byte urgentIds[URGENT_IDS];
+	byte urgentCount;
+#endif
+	byte messageBuffer[RX_QUEUE_SIZE][MESSAGE_MAX_PAYLOAD_SIZE];
+	AdvancedSerialMessage messages[RX_QUEUE_SIZE];
+#ifdef SLIDING_WINDOW
+	byte windowBuffer[TX_WINDOW_SIZE][MESSAGE_MAX_PAYLOAD_SIZE];
+	AdvancedSerialMessage windowMessages[TX_WINDOW_SIZE];
+	unsigned long windowMillis[TX_WINDOW_SIZE];
+#endif
+	byte controlBuffer[CONTROL_PAYLOAD_SIZE];
+	AdvancedSerialMessage frame;
+	AdvancedSerialStatistics statistics;
+#ifdef DENSE_HANDLER_TABLE
+	AdvancedSerialHandler handlers[256];
+#else
+	AdvancedSerialHandler handlers[MAX_HANDLERS];
+#endif
+	byte handlerCount;
+#ifdef COMPRESSION
+	AdvancedSerialCompression compressions[COMPRESSION_CHANNELS];
+	byte compressionCount;
+#endif
 	AdvancedSerialMessage* message;
+	unsigned long baudInitial;
+	unsigned long baudCurrent;
+	unsigned long baudMillis;
+	unsigned long baudErrors;
+	byte baudPending;
+	bool baudConfirmed;
 	void (*onReceive)(AdvancedSerialMessage* Message);
+	void (*onBulkReceive)(byte id, byte* data, unsigned int size);
+	void setOptions(byte options);
+	byte queue(byte type, byte id, byte size, byte* payload);
+	void sendFragments();
+	void reassemble(AdvancedSerialMessage* fragment);
+#ifdef COMPRESSION
+	AdvancedSerialCompression* findCompression(byte id);
+	byte compress(AdvancedSerialCompression* channel, byte size, byte* payload);
+#endif
+	AdvancedSerialHandler* findHandler(byte id);
+	void dispatch(AdvancedSerialMessage* message);
 	void send(byte type, byte id, byte size, byte* payload);
-
+	bool transmit(byte type, byte id, byte sequence, byte size, byte* payload);
+#ifdef URGENT_LANE
+	bool isUrgent(byte type, byte id);
+#endif
+	bool transmitting();
+	void drain();
+	void push(byte data);
+	void acknowledge(byte type);
+	void sendStatistics(byte first);
+	unsigned long linkErrors();
+	void confirmBaud();
+	void switchBaud();
+#ifdef SLIDING_WINDOW
+	void acknowledged(byte type);
+	void retransmit();
+#endif
+	void write(byte data);
+	void writeSpan(byte* data, byte size, uint16_t* checksum);
+	void parse();
+	void parseSpans();
+	void parseStuffed();
+	void readSpan(byte* target, byte size);
+	void storeByte(byte data);
+	void headerReceived();
+	void messageReceived();
+	void nextMessage();
+	//the host benchmark times parse() apart from the rest of loop()
+	friend class SpanParser;
 };
 
+template<class T, void (*onReceive)(const T& value)> bool AdvancedSerialClass::setHandler(byte id) {
+	verifyPayload<T>();
+	return this->setHandler(id, receivePayload<T, onReceive>, sizeof(T));
+}
+
+template<class T> byte AdvancedSerialClass::send(byte id, const T& value) {
+	verifyPayload<T>();
+	return this->send(id, sizeof(T), (byte*)&value);
+}
+
 //global instance
 extern AdvancedSerialClass AdvancedSerial;
 
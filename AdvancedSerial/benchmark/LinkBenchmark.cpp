@@ -0,0 +1,284 @@
+/*
+  LinkBenchmark.cpp - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  Measures the whole link: the firmware built for the host runs in a child
+  process behind a pseudo-terminal, the native client drives it from here.
+  For every payload size from 0 to MESSAGE_MAX_PAYLOAD_SIZE it reports
+  frames per second and goodput, then acknowledge round-trip percentiles
+  from one message at a time, and the cycles the board spent per received
+  byte. Bytes can be corrupted or dropped in both directions to see what
+  resynchronization and retransmission cost. Results are written as JSON.
+
+  usage: LinkBenchmark [-n messages] [-l latency samples] [-o options]
+                       [-c corrupt ppm] [-d drop ppm] [-t retransmit ms]
+                       [-s seed] [-f output.json]
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include <sys/wait.h>
+#include "AdvancedSerialClient.h"
+#include "AdvancedSerialPoller.h"
+#include "LinkDevice.h"
+
+using namespace ebl_arduino;
+
+struct SizeResult {
+	int size;
+	double seconds;
+	unsigned long retransmitted;
+};
+
+static bool linkUp;
+static unsigned long statistics[STATISTICS_COUNT];
+static int statisticsReceived;
+
+static const char* statisticsNames[STATISTICS_COUNT] = {
+	"frames_received", "frames_sent", "acknowledges_sent", "acknowledges_received",
+	"size_rejects", "delimiter_errors", "checksum_errors", "bytes_discarded",
+	"receive_overruns", "transmit_stalls", "retransmits", "urgent_frames_sent",
+	"normal_queue_delay_ms", "urgent_queue_delay_ms", "normal_queue_delay_max_ms", "urgent_queue_delay_max_ms"
+};
+
+static double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec/1e9;
+}
+
+static void onLink(AdvancedSerialClient* client, byte type, void* context) {
+	if (type == SETUP_RESPONSE)
+		linkUp = true;
+}
+
+static void onStatistics(AdvancedSerialClient* client, byte first, const unsigned long* counters, byte count, void* context) {
+	for (int i = 0; i < count && first+i < STATISTICS_COUNT; i++)
+		statistics[first+i] = counters[i];
+	statisticsReceived = first+count;
+}
+
+static pid_t openDevice(int* master, int* report, unsigned long corrupt, unsigned long drop, unsigned long seed) {
+	struct termios settings;
+	int slave, pipes[2];
+	pid_t pid;
+
+	*master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (*master < 0 || grantpt(*master) < 0 || unlockpt(*master) < 0)
+		return -1;
+	slave = open(ptsname(*master), O_RDWR | O_NOCTTY);
+	if (slave < 0 || pipe(pipes) < 0)
+		return -1;
+
+	//no line discipline between the two ends
+	tcgetattr(slave, &settings);
+	cfmakeraw(&settings);
+	tcsetattr(slave, TCSANOW, &settings);
+
+	pid = fork();
+	if (pid == 0) {
+		close(*master);
+		close(pipes[0]);
+		fcntl(slave, F_SETFL, fcntl(slave, F_GETFL) | O_NONBLOCK);
+		deviceRun(slave, pipes[1], corrupt, drop, seed);
+		_exit(0);
+	}
+	close(slave);
+	close(pipes[1]);
+	*report = pipes[0];
+	return pid;
+}
+
+//keep the window fed until every message is acknowledged, false on timeout
+static bool run(AdvancedSerialPoller& poller, AdvancedSerialClient& client, int size, unsigned long messages) {
+	byte payload[MESSAGE_MAX_PAYLOAD_SIZE];
+	unsigned long sent = 0;
+	double deadline = now()+60;
+
+	for (int i = 0; i < size; i++)
+		payload[i] = i;
+	while ((sent < messages || client.pending() > 0) && client.isOpen()) {
+		while (sent < messages && client.pending() < 32) {
+			payload[0] = sent;
+			client.send(sent & 0xFF, size, payload);
+			sent++;
+		}
+		poller.poll(100);
+		if (now() > deadline)
+			return false;
+	}
+	return client.isOpen();
+}
+
+static double percentile(std::vector<double>& samples, double rank) {
+	if (samples.empty())
+		return 0;
+	return samples[(size_t)(rank*(samples.size()-1))];
+}
+
+int main(int argc, char** argv) {
+	unsigned long messages = 10000;
+	unsigned long latencySamples = 2000;
+	unsigned long corrupt = 0, drop = 0, seed = 1;
+	unsigned long retransmitTimeout = 50;
+	int options = OPTION_STUFFING|OPTION_CHECKSUM|OPTION_WINDOW;
+	const char* file = "LinkBenchmark.json";
+	std::vector<SizeResult> results;
+	std::vector<double> latency;
+	LinkDeviceReport report;
+	AdvancedSerialPoller poller;
+	AdvancedSerialClient client;
+	int master, reportFd, option;
+	unsigned long retransmitted;
+	double started;
+	pid_t pid;
+	FILE* out;
+
+	while ((option = getopt(argc, argv, "n:l:o:c:d:t:s:f:")) != -1) {
+		switch (option) {
+			case 'n': messages = strtoul(optarg, NULL, 10); break;
+			case 'l': latencySamples = strtoul(optarg, NULL, 10); break;
+			case 'o': options = strtol(optarg, NULL, 0); break;
+			case 'c': corrupt = strtoul(optarg, NULL, 10); break;
+			case 'd': drop = strtoul(optarg, NULL, 10); break;
+			case 't': retransmitTimeout = strtoul(optarg, NULL, 10); break;
+			case 's': seed = strtoul(optarg, NULL, 10); break;
+			case 'f': file = optarg; break;
+			default:
+				fprintf(stderr, "usage: LinkBenchmark [-n messages] [-l latency samples] [-o options] [-c corrupt ppm] [-d drop ppm] [-t retransmit ms] [-s seed] [-f output.json]\n");
+				return 1;
+		}
+	}
+
+	pid = openDevice(&master, &reportFd, corrupt, drop, seed);
+	if (pid < 0) {
+		perror("pseudo-terminal");
+		return 1;
+	}
+	client.attach(master);
+	client.retransmitTimeout = retransmitTimeout;
+	client.setLinkReceiver(onLink);
+	client.setStatisticsReceiver(onStatistics);
+	poller.add(&client);
+
+	//discovery is not retransmitted, repeat it until the link is up
+	linkUp = false;
+	started = now();
+	while (!linkUp && now()-started < 10) {
+		client.discover();
+		client.setup(options);
+		for (int i = 0; i < 10 && !linkUp; i++)
+			poller.poll(10);
+	}
+	if (!linkUp) {
+		fprintf(stderr, "no answer from the board\n");
+		return 1;
+	}
+
+	printf("options %d, %lu messages per size, corrupt %lu ppm, drop %lu ppm\n", client.getOptions(), messages, corrupt, drop);
+	printf("%4s %12s %14s %12s\n", "size", "frames/s", "goodput B/s", "retransmits");
+	for (int size = 0; size <= MESSAGE_MAX_PAYLOAD_SIZE; size++) {
+		SizeResult result;
+		retransmitted = client.retransmitted;
+		started = now();
+		if (!run(poller, client, size, messages)) {
+			fprintf(stderr, "link stalled at payload size %d\n", size);
+			return 1;
+		}
+		result.size = size;
+		result.seconds = now()-started;
+		result.retransmitted = client.retransmitted-retransmitted;
+		results.push_back(result);
+		printf("%4d %12.0f %14.0f %12lu\n", size, messages/result.seconds, messages*size/result.seconds, result.retransmitted);
+	}
+
+	//one message in flight, time until its acknowledge
+	for (unsigned long i = 0; i < latencySamples; i++) {
+		started = now();
+		if (!run(poller, client, 8, 1))
+			break;
+		latency.push_back((now()-started)*1e6);
+	}
+	std::sort(latency.begin(), latency.end());
+	printf("round trip us: p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+		percentile(latency, 0.5), percentile(latency, 0.9), percentile(latency, 0.99), percentile(latency, 1));
+
+	//the board's own link counters, a page at a time
+	statisticsReceived = 0;
+	started = now();
+	while (statisticsReceived < STATISTICS_COUNT && now()-started < 2) {
+		client.requestStatistics(statisticsReceived);
+		for (int i = 0; i < 10 && statisticsReceived < STATISTICS_COUNT; i++)
+			poller.poll(10);
+	}
+
+	//closing the master ends the board loop, which reports back
+	client.close();
+	close(master);
+	memset(&report, 0, sizeof(report));
+	if (read(reportFd, &report, sizeof(report)) != sizeof(report))
+		fprintf(stderr, "no report from the board\n");
+	waitpid(pid, NULL, 0);
+	printf("board: %llu bytes, %.2f cycles/byte in loop(), %lu corrupted, %lu dropped\n",
+		report.bytes, report.bytes ? (double)report.cycles/report.bytes : 0.0, report.corrupted, report.dropped);
+
+	out = fopen(file, "w");
+	if (out == NULL) {
+		perror(file);
+		return 1;
+	}
+	fprintf(out, "{\n");
+	fprintf(out, "  \"options\": %d,\n  \"messages\": %lu,\n  \"max_payload_size\": %d,\n", client.getOptions(), messages, MESSAGE_MAX_PAYLOAD_SIZE);
+	fprintf(out, "  \"corrupt_ppm\": %lu,\n  \"drop_ppm\": %lu,\n  \"retransmit_timeout_ms\": %lu,\n", corrupt, drop, retransmitTimeout);
+	fprintf(out, "  \"throughput\": [\n");
+	for (size_t i = 0; i < results.size(); i++) {
+		fprintf(out, "    {\"size\": %d, \"frames_per_second\": %.1f, \"goodput_bytes_per_second\": %.1f, \"retransmits\": %lu}%s\n",
+			results[i].size, messages/results[i].seconds, messages*results[i].size/results[i].seconds,
+			results[i].retransmitted, (i+1 < results.size()) ? "," : "");
+	}
+	fprintf(out, "  ],\n");
+	fprintf(out, "  \"latency_us\": {\"samples\": %lu, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f},\n",
+		(unsigned long)latency.size(), percentile(latency, 0.5), percentile(latency, 0.9), percentile(latency, 0.99), percentile(latency, 1));
+	fprintf(out, "  \"board\": {\"bytes\": %llu, \"loop_cycles_per_byte\": %.2f, \"messages\": %lu, \"corrupted\": %lu, \"dropped\": %lu},\n",
+		report.bytes, report.bytes ? (double)report.cycles/report.bytes : 0.0, report.messages, report.corrupted, report.dropped);
+	fprintf(out, "  \"statistics\": {");
+	for (int i = 0; i < STATISTICS_COUNT; i++)
+		fprintf(out, "%s\"%s\": %lu", i ? ", " : "", statisticsNames[i], statistics[i]);
+	fprintf(out, "}\n");
+	fprintf(out, "}\n");
+	fclose(out);
+	return 0;
+}
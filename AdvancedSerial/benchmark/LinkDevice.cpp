@@ -0,0 +1,163 @@
+/*
+  LinkDevice.cpp - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  Board side of LinkBenchmark: the firmware behind the slave end of a
+  pseudo-terminal, swallowing every message. Bytes in both directions can
+  be corrupted or dropped at a given rate, and the cycles spent in
+  AdvancedSerial.loop() are counted against the bytes it was fed.
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#include "AdvancedSerial.h"
+#include "LinkDevice.h"
+
+static int deviceFd;
+static unsigned long corruptPpm;
+static unsigned long dropPpm;
+static unsigned long randomState;
+static LinkDeviceReport report;
+
+static unsigned long long cycles() {
+#if defined(__i386__) || defined(__x86_64__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec*1000000000ULL + now.tv_nsec;
+#endif
+}
+
+static unsigned long nextRandom() {
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 17;
+	randomState ^= randomState << 5;
+	return randomState;
+}
+
+//damage a span in place, returns its new length
+static size_t inject(byte* data, size_t size) {
+	size_t kept = 0;
+
+	if (corruptPpm == 0 && dropPpm == 0)
+		return size;
+	for (size_t i = 0; i < size; i++) {
+		if (nextRandom() % 1000000 < dropPpm) {
+			report.dropped++;
+			continue;
+		}
+		data[kept] = data[i];
+		if (nextRandom() % 1000000 < corruptPpm) {
+			data[kept] ^= 1 << (nextRandom() % 8);
+			report.corrupted++;
+		}
+		kept++;
+	}
+	return kept;
+}
+
+//the stand-in hands over one byte per write, collect them for one system call per pass
+static byte output[4096];
+static size_t outputSize;
+
+static void onWrite(const byte* data, size_t size) {
+	if (outputSize+size > sizeof(output))
+		size = sizeof(output)-outputSize;
+	memcpy(output+outputSize, data, size);
+	outputSize += size;
+}
+
+static void flush() {
+	byte* data = output;
+	size_t size = inject(output, outputSize);
+	ssize_t written;
+
+	while (size > 0) {
+		written = write(deviceFd, data, size);
+		if (written < 0 && errno != EINTR && errno != EAGAIN)
+			break;
+		if (written > 0) {
+			data += written;
+			size -= written;
+		}
+	}
+	outputSize = 0;
+}
+
+static void onMessage(AdvancedSerialMessage* message) {
+	report.messages++;
+}
+
+void deviceRun(int fd, int reportFd, unsigned long corrupt, unsigned long drop, unsigned long seed) {
+	struct pollfd port;
+	byte data[SERIAL_BUFFER_SIZE];
+	unsigned long long started;
+	ssize_t received;
+	int space;
+
+	deviceFd = fd;
+	corruptPpm = corrupt;
+	dropPpm = drop;
+	randomState = seed | 1;
+	outputSize = 0;
+	memset(&report, 0, sizeof(report));
+
+	Serial.begin(115200);
+	Serial.setSink(onWrite);
+	AdvancedSerial.setReceiver(onMessage);
+
+	port.fd = fd;
+	port.events = POLLIN;
+	while (true) {
+		poll(&port, 1, 1);
+
+		//no more than the receive ring takes, as the UART would
+		space = SERIAL_BUFFER_SIZE-1-Serial.available();
+		if (space > 0) {
+			received = read(fd, data, space);
+			if (received == 0 || (received < 0 && errno != EAGAIN && errno != EINTR))
+				break;
+			if (received > 0) {
+				report.bytes += received;
+				Serial.feed(data, inject(data, received));
+			}
+		}
+
+		started = cycles();
+		AdvancedSerial.loop();
+		report.cycles += cycles()-started;
+		flush();
+	}
+
+	write(reportFd, &report, sizeof(report));
+}
@@ -0,0 +1,237 @@
+/*
+  ParserBenchmark.cpp - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  Measures receive parser cost in CPU cycles per received byte. The stream is
+  fed through the host Serial stand-in in bursts no larger than the AVR
+  receive ring, so frames are split across calls the same way they are on a
+  board. The per-byte switch parser AdvancedSerial shipped with is kept here
+  as the reference. The parse column times the parser alone, the loop column
+  adds the rest of loop(): dispatching messages and draining acknowledges.
+
+  usage: ParserBenchmark [frames] [noise percent]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#include "AdvancedSerial.h"
+
+static unsigned long long cycles() {
+#if defined(__i386__) || defined(__x86_64__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec*1000000000ULL + now.tv_nsec;
+#endif
+}
+
+//per-byte dispatch, as AdvancedSerialClass::loop() did before the span parser;
+//it answers inline, so nothing is left for loop()
+class LegacyParser
+{
+  public:
+    LegacyParser();
+	void parse();
+	void loop() {}
+	unsigned long received;
+
+  private:
+	byte bufferCondition;
+	byte bufferPosition;
+	AdvancedSerialMessage message;
+	byte payload[MESSAGE_MAX_PAYLOAD_SIZE];
+	void send(byte type);
+};
+
+LegacyParser::LegacyParser() {
+	this->bufferCondition = READING_STX;
+	this->bufferPosition = 0;
+	this->message.payload = this->payload;
+	this->received = 0;
+}
+
+void LegacyParser::send(byte type) {
+	Serial.write((byte)DELIMITER_STX);
+	Serial.write(type);
+	Serial.write((byte)0);
+	Serial.write((byte)0);
+	Serial.write((byte)DELIMITER_ETX);
+}
+
+void LegacyParser::parse() {
+	while(Serial.available() > 0) {
+		switch(bufferCondition) {
+			case READING_STX:
+				if ( Serial.read() == DELIMITER_STX) {
+					this->bufferCondition = READING_HEADER;
+				}
+				break;
+
+			case READING_HEADER:
+				((byte*)&this->message)[this->bufferPosition] = Serial.read();
+				this->bufferPosition++;
+				if ( this->bufferPosition == MESSAGE_HEADER_SIZE ) {
+					this->bufferPosition = 0;
+					if (this->message.size == 0) {
+						this->bufferCondition = READING_ETX;
+					} else if (this->message.size > 0 && this->message.size <= MESSAGE_MAX_PAYLOAD_SIZE) {
+						this->bufferCondition = READING_PAYLOAD;
+					} else {
+						this->bufferCondition = READING_STX;
+					}
+				}
+				break;
+
+			case READING_PAYLOAD:
+				this->message.payload[this->bufferPosition] = Serial.read();
+				this->bufferPosition++;
+				if ( this->bufferPosition == this->message.size ) {
+					this->bufferCondition = READING_ETX;
+				}
+				break;
+
+			case READING_ETX:
+				if ( Serial.read() == DELIMITER_ETX) {
+					if (this->message.type == MESSAGE) {
+						this->send(MESSAGE_ACKNOWLEDGE);
+						this->received++;
+					}
+				}
+				this->bufferCondition = READING_STX;
+				this->bufferPosition = 0;
+				break;
+		}
+	}
+}
+
+static unsigned long received;
+
+static void onMessage(AdvancedSerialMessage* message) {
+	received++;
+}
+
+static unsigned long seed = 1;
+
+static byte random8() {
+	seed = seed*1103515245UL + 12345UL;
+	return (byte)(seed >> 16);
+}
+
+//frames with random ids and payload sizes, optionally separated by line noise
+static size_t buildStream(byte* stream, unsigned long frames, int noisePercent) {
+	size_t length = 0;
+
+	for (unsigned long i = 0; i < frames; i++) {
+		byte size = random8() % (MESSAGE_MAX_PAYLOAD_SIZE+1);
+
+		if (random8() % 100 < noisePercent) {
+			byte noise = 1 + random8() % 8;
+			while (noise-- > 0) {
+				byte data = random8();
+				stream[length++] = (data == DELIMITER_STX) ? 0 : data;
+			}
+		}
+
+		stream[length++] = DELIMITER_STX;
+		stream[length++] = MESSAGE;
+		stream[length++] = random8();
+		stream[length++] = size;
+		for (byte j = 0; j < size; j++)
+			stream[length++] = random8();
+		stream[length++] = DELIMITER_ETX;
+	}
+	return length;
+}
+
+//AdvancedSerial split at parse(), loop() then finds the port empty and only dispatches and drains
+class SpanParser
+{
+  public:
+	void parse() { AdvancedSerial.parse(); }
+	void loop() { AdvancedSerial.loop(); }
+};
+
+//spent[0] is the parser alone, spent[1] the whole loop
+template<class Parser> static void run(Parser& parser, const byte* stream, size_t length, unsigned long long* spent) {
+	size_t position = 0;
+
+	spent[0] = spent[1] = 0;
+	while (position < length) {
+		short burst = (length-position > SERIAL_BUFFER_SIZE-1) ? SERIAL_BUFFER_SIZE-1 : (short)(length-position);
+		position += Serial.feed(stream+position, burst);
+
+		unsigned long long start = cycles();
+		parser.parse();
+		unsigned long long parsed = cycles();
+		parser.loop();
+		spent[0] += parsed-start;
+		spent[1] += cycles()-start;
+	}
+}
+
+static void keepBest(unsigned long long* best, const unsigned long long* spent) {
+	for (int i = 0; i < 2; i++)
+		if (spent[i] < best[i]) best[i] = spent[i];
+}
+
+int main(int argc, char** argv) {
+	unsigned long frames = (argc > 1) ? strtoul(argv[1], NULL, 10) : 100000;
+	int noisePercent = (argc > 2) ? atoi(argv[2]) : 0;
+	byte* stream = (byte*) malloc(frames*(MESSAGE_MAX_PAYLOAD_SIZE+MESSAGE_HEADER_SIZE+2+8));
+	size_t length = buildStream(stream, frames, noisePercent);
+	unsigned long long best[2][2] = { { ~0ULL, ~0ULL }, { ~0ULL, ~0ULL } };
+	unsigned long long spent[2];
+	unsigned long legacyReceived = 0;
+	SpanParser span;
+
+	AdvancedSerial.setReceiver(onMessage);
+
+	for (int round = 0; round < 5; round++) {
+		LegacyParser legacy;
+		run(legacy, stream, length, spent);
+		keepBest(best[0], spent);
+		legacyReceived = legacy.received;
+
+		received = 0;
+		run(span, stream, length, spent);
+		keepBest(best[1], spent);
+	}
+
+	printf("%lu frames, %lu bytes, %d%% noise, cycles/byte\n", frames, (unsigned long)length, noisePercent);
+	printf("%-8s %10s %8s %8s\n", "parser", "frames", "parse", "loop");
+	printf("%-8s %10lu %8.2f %8.2f\n", "legacy", legacyReceived, (double)best[0][0]/length, (double)best[0][1]/length);
+	printf("%-8s %10lu %8.2f %8.2f\n", "span", received, (double)best[1][0]/length, (double)best[1][1]/length);
+
+	free(stream);
+	return 0;
+}
@@ -0,0 +1,110 @@
+/*
+  HostSerial.cpp - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <time.h>
+#include "WProgram.h"
+
+static unsigned long long monotonicMicros() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec*1000000ULL + now.tv_nsec/1000;
+}
+
+static unsigned long long startMicros = monotonicMicros();
+
+unsigned long millis() {
+	return (unsigned long)((monotonicMicros()-startMicros)/1000);
+}
+
+unsigned long micros() {
+	return (unsigned long)(monotonicMicros()-startMicros);
+}
+
+HardwareSerial::HardwareSerial() {
+	this->head = 0;
+	this->tail = 0;
+	this->written = 0;
+	this->onWrite = NULL;
+}
+
+void HardwareSerial::begin(long baud) {
+	this->head = this->tail;
+}
+
+int HardwareSerial::available() {
+	return (SERIAL_BUFFER_SIZE + this->head - this->tail) % SERIAL_BUFFER_SIZE;
+}
+
+int HardwareSerial::availableForWrite() {
+	return SERIAL_BUFFER_SIZE-1;
+}
+
+int HardwareSerial::read() {
+	if (this->head == this->tail)
+		return -1;
+
+	byte data = this->buffer[this->tail];
+	this->tail = (this->tail+1) % SERIAL_BUFFER_SIZE;
+	return data;
+}
+
+int HardwareSerial::peek() {
+	if (this->head == this->tail)
+		return -1;
+	return this->buffer[this->tail];
+}
+
+void HardwareSerial::flush() {
+}
+
+void HardwareSerial::write(byte data) {
+	this->write(&data, 1);
+}
+
+void HardwareSerial::write(const byte* data, size_t size) {
+	this->written += size;
+	if (this->onWrite != NULL)
+		this->onWrite(data, size);
+}
+
+short HardwareSerial::feed(const byte* data, short size) {
+	short accepted = 0;
+
+	//like the UART interrupt, stop when the ring is full
+	while (accepted < size && (this->head+1) % SERIAL_BUFFER_SIZE != this->tail) {
+		this->buffer[this->head] = data[accepted++];
+		this->head = (this->head+1) % SERIAL_BUFFER_SIZE;
+	}
+	return accepted;
+}
+
+void HardwareSerial::setSink(void (*onWrite)(const byte* data, size_t size)) {
+	this->onWrite = onWrite;
+}
+
+HardwareSerial Serial;
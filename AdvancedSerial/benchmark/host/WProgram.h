@@ -0,0 +1,78 @@
+/*
+  WProgram.h - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  Host stand-in for the Arduino core, just enough to build AdvancedSerial.cpp
+  on a PC. Serial behaves like the AVR HardwareSerial receive ring: bytes are
+  pushed in with feed() as the UART interrupt would, and everything written
+  is counted and optionally forwarded to a sink.
+*/
+
+#ifndef WProgram_h
+#define WProgram_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define SERIAL_BUFFER_SIZE 64
+
+#include <avr/pgmspace.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+unsigned long millis();
+unsigned long micros();
+
+class HardwareSerial
+{
+  public:
+    HardwareSerial();
+	void begin(long baud);
+	int available();
+	int availableForWrite();
+	int read();
+	int peek();
+	void flush();
+	void write(byte data);
+	void write(const byte* data, size_t size);
+	short feed(const byte* data, short size);
+	void setSink(void (*onWrite)(const byte* data, size_t size));
+	unsigned long written;
+
+  private:
+	byte buffer[SERIAL_BUFFER_SIZE];
+	volatile byte head;
+	volatile byte tail;
+	void (*onWrite)(const byte* data, size_t size);
+};
+
+extern HardwareSerial Serial;
+
+#endif
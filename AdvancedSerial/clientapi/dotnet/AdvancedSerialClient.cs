@@ -33,6 +33,15 @@ namespace ebl_arduino
                 return false;
         }
 
+        /// <summary>
+        /// Rate of the serial port, changed when the device agrees to switch.
+        /// </summary>
+        protected override int BaudRate
+        {
+            get { return this.Port.BaudRate; }
+            set { this.Port.BaudRate = value; }
+        }
+
         /// <summary>
         /// Close serial port.
         /// </summary>
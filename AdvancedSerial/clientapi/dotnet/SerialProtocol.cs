@@ -1,5 +1,7 @@
 ﻿using System;
+using System.Collections.Generic;
 using System.IO;
+using System.Runtime.InteropServices;
 using System.Threading;
 
 namespace ebl_arduino
@@ -15,7 +17,7 @@ namespace ebl_arduino
         public enum MessageTypes
         {
             /// <summary>
-            /// Common message.
+            /// Link statistics request and response.
             /// </summary>
             DEBUG = 0x01,
 
@@ -37,7 +39,118 @@ namespace ebl_arduino
             /// <summary>
             /// Discovery response message.
             /// </summary>
-            DISCOVERY_RESPONSE = 0x05
+            DISCOVERY_RESPONSE = 0x05,
+
+            /// <summary>
+            /// Link options request.
+            /// </summary>
+            SETUP_REQUEST = 0x06,
+
+            /// <summary>
+            /// Link options accepted by the device.
+            /// </summary>
+            SETUP_RESPONSE = 0x07,
+
+            /// <summary>
+            /// Message rejected, checksum mismatch.
+            /// </summary>
+            MESSAGE_NEGATIVE_ACKNOWLEDGE = 0x08,
+
+            /// <summary>
+            /// Piece of a bulk message: index, count, data.
+            /// </summary>
+            FRAGMENT = 0x09,
+
+            /// <summary>
+            /// Message from a compressed ID, delivered decoded as MESSAGE.
+            /// </summary>
+            COMPRESSED = 0x0A
+        }
+
+        /// <summary>
+        /// Link counters reported by the device, in response order.
+        /// </summary>
+        public enum Statistics
+        {
+            /// <summary>
+            /// Frames received whole.
+            /// </summary>
+            FRAMES_RECEIVED = 0,
+
+            /// <summary>
+            /// Frames queued for the UART, acknowledges included.
+            /// </summary>
+            FRAMES_SENT = 1,
+
+            /// <summary>
+            /// Acknowledges and negative acknowledges sent.
+            /// </summary>
+            ACKNOWLEDGES_SENT = 2,
+
+            /// <summary>
+            /// Acknowledges and negative acknowledges received.
+            /// </summary>
+            ACKNOWLEDGES_RECEIVED = 3,
+
+            /// <summary>
+            /// Headers announcing a payload over the maximum.
+            /// </summary>
+            SIZE_REJECTS = 4,
+
+            /// <summary>
+            /// Frames whose ETX was missing or early.
+            /// </summary>
+            DELIMITER_ERRORS = 5,
+
+            /// <summary>
+            /// Frames failing the checksum.
+            /// </summary>
+            CHECKSUM_ERRORS = 6,
+
+            /// <summary>
+            /// Bytes skipped while looking for STX.
+            /// </summary>
+            BYTES_DISCARDED = 7,
+
+            /// <summary>
+            /// Messages dropped for lack of a free receive slot.
+            /// </summary>
+            RECEIVE_OVERRUNS = 8,
+
+            /// <summary>
+            /// Frames refused by a full transmit buffer.
+            /// </summary>
+            TRANSMIT_STALLS = 9,
+
+            /// <summary>
+            /// Frames sent again after the timeout.
+            /// </summary>
+            RETRANSMITS = 10,
+
+            /// <summary>
+            /// Frames sent through the urgent lane, acknowledges included.
+            /// </summary>
+            URGENT_FRAMES_SENT = 11,
+
+            /// <summary>
+            /// Milliseconds normal frames waited in total before reaching the wire.
+            /// </summary>
+            NORMAL_QUEUE_DELAY = 12,
+
+            /// <summary>
+            /// Milliseconds urgent frames waited in total before reaching the wire.
+            /// </summary>
+            URGENT_QUEUE_DELAY = 13,
+
+            /// <summary>
+            /// Longest wait of a normal frame, in milliseconds.
+            /// </summary>
+            NORMAL_QUEUE_DELAY_MAX = 14,
+
+            /// <summary>
+            /// Longest wait of an urgent frame, in milliseconds.
+            /// </summary>
+            URGENT_QUEUE_DELAY_MAX = 15
         }
 
         /// <summary>
@@ -60,12 +173,43 @@ namespace ebl_arduino
             /// </summary>
             public byte Size = 0;
 
+            /// <summary>
+            /// Sequence number, used when windowing is on.
+            /// </summary>
+            public byte Sequence = 0;
+
             /// <summary>
             /// Message payload.
             /// </summary>
             public byte[] Payload;
         }
 
+        /// <summary>
+        /// Device description carried by DISCOVERY_RESPONSE, all zero for devices predating it.
+        /// </summary>
+        public class Capabilities
+        {
+            /// <summary>
+            /// Protocol version.
+            /// </summary>
+            public byte Version;
+
+            /// <summary>
+            /// Largest payload the device accepts.
+            /// </summary>
+            public byte MaxPayloadSize;
+
+            /// <summary>
+            /// Link options the device supports.
+            /// </summary>
+            public byte Options;
+
+            /// <summary>
+            /// Rates the device can switch to, bit n standing for BAUD_RATES[n].
+            /// </summary>
+            public byte BaudRates;
+        }
+
         /// <summary>
         /// Connection states.
         /// </summary>
@@ -89,7 +233,12 @@ namespace ebl_arduino
             /// <summary>
             /// Receiving payload.
             /// </summary>
-            ReadingPayload
+            ReadingPayload,
+
+            /// <summary>
+            /// Receiving sequence number.
+            /// </summary>
+            ReadingSequence
         }
 
         /// <summary>
@@ -97,20 +246,75 @@ namespace ebl_arduino
         /// </summary>
         public const int MESSAGE_HEADER_SIZE = 3;
 
+        /// <summary>
+        /// Size of sequence number, appended to the header when windowing is on.
+        /// </summary>
+        public const int SEQUENCE_SIZE = 1;
+
         /// <summary>
         /// Size of message delimiter.
         /// </summary>
         public const int MESSAGE_DELIMITER_SIZE = 1;
 
         /// <summary>
-        /// Maximum size of message payload.
+        /// Maximum size of message payload, must match MESSAGE_MAX_PAYLOAD_SIZE on the device.
         /// </summary>
         public const int MESSAGE_MAX_PAYLOAD_SIZE = 32;
 
+        /// <summary>
+        /// Size of fragment index and count.
+        /// </summary>
+        public const int FRAGMENT_HEADER_SIZE = 2;
+
+        /// <summary>
+        /// Bulk data carried by each fragment.
+        /// </summary>
+        public const int FRAGMENT_DATA_SIZE = MESSAGE_MAX_PAYLOAD_SIZE - FRAGMENT_HEADER_SIZE;
+
+        /// <summary>
+        /// Size of the compressed frame header: keyframe flag and 7 bit counter.
+        /// </summary>
+        public const int COMPRESSED_HEADER_SIZE = 1;
+
         /// <summary>
         /// Maximum size of message.
         /// </summary>
-        public const int MESSAGE_SIZE = MESSAGE_MAX_PAYLOAD_SIZE + MESSAGE_HEADER_SIZE;
+        public const int MESSAGE_SIZE = MESSAGE_MAX_PAYLOAD_SIZE + MESSAGE_HEADER_SIZE + SEQUENCE_SIZE;
+
+        /// <summary>
+        /// Link option: several messages in flight, with sequence numbers and selective acknowledges.
+        /// </summary>
+        public const byte OPTION_WINDOW = 0x04;
+
+        /// <summary>
+        /// Link options this client can speak.
+        /// </summary>
+        public const byte SUPPORTED_OPTIONS = OPTION_WINDOW;
+
+        /// <summary>
+        /// Maximum number of messages in flight, width of the selective acknowledge bitmap.
+        /// </summary>
+        public const int MAX_WINDOW_SIZE = 8;
+
+        /// <summary>
+        /// Size of the DISCOVERY_RESPONSE device description.
+        /// </summary>
+        public const int CAPABILITY_SIZE = 4;
+
+        /// <summary>
+        /// Rates a SETUP_REQUEST may switch to, by code.
+        /// </summary>
+        public static readonly int[] BAUD_RATES = { 9600, 19200, 38400, 57600, 115200, 250000, 500000, 1000000 };
+
+        /// <summary>
+        /// Rate code meaning no change.
+        /// </summary>
+        public const byte NO_BAUD = 0xFF;
+
+        /// <summary>
+        /// Time after which a device that heard no good frame at a new rate returns to its initial one.
+        /// </summary>
+        public const int BAUD_FALLBACK_TIMEOUT = 1000;
 
         /// <summary>
         /// Start of message.
@@ -132,6 +336,26 @@ namespace ebl_arduino
         /// </summary>
         public event MessageReceivedCallback MessageReceived;
 
+        /// <summary>
+        /// Delegate method for BulkReceived.
+        /// </summary>
+        public delegate void BulkReceivedCallback(byte ID, byte[] Data);
+
+        /// <summary>
+        /// Occurs when every fragment of a bulk message is received.
+        /// </summary>
+        public event BulkReceivedCallback BulkReceived;
+
+        /// <summary>
+        /// Delegate method for StatisticsReceived.
+        /// </summary>
+        public delegate void StatisticsReceivedCallback(byte First, uint[] Counters);
+
+        /// <summary>
+        /// Occurs when the device reports its link counters.
+        /// </summary>
+        public event StatisticsReceivedCallback StatisticsReceived;
+
         /// <summary>
         /// Protocol stream.
         /// </summary>
@@ -148,11 +372,26 @@ namespace ebl_arduino
         /// </summary>
         public abstract void Close();
 
+        /// <summary>
+        /// Rate of the transport, changed when the device agrees to switch.
+        /// </summary>
+        protected abstract int BaudRate { get; set; }
+
+        /// <summary>
+        /// Description of the device, filled in by its DISCOVERY_RESPONSE.
+        /// </summary>
+        public Capabilities DeviceCapabilities = new Capabilities();
+
         /// <summary>
         /// Timeout for message confirmation.
         /// </summary>
         public int MessageTimeout = 2000;
 
+        /// <summary>
+        /// Time before an unacknowledged message is sent again, when windowing is on.
+        /// </summary>
+        public int RetransmitTimeout = 250;
+
         private AdvancedSerialMessage InputMessage = new AdvancedSerialMessage();
         private byte[] InputBuffer = new byte[MESSAGE_SIZE];
         private byte[] InputDelimiter = new byte[1];
@@ -160,6 +399,98 @@ namespace ebl_arduino
         private int ReceivedBytes;
         private int RequestedBytes;
 
+        private byte Options = 0;
+        private int HeaderSize = MESSAGE_HEADER_SIZE;
+        private object WriteLock = new object();
+
+        private object WindowLock = new object();
+        private AdvancedSerialMessage[] Window = new AdvancedSerialMessage[MAX_WINDOW_SIZE];
+        private int[] WindowTicks = new int[MAX_WINDOW_SIZE];
+        private byte WindowBase;
+        private int WindowCount;
+        private int WindowAcknowledged;
+        private int WindowLimit;
+        private Timer RetransmitTimer;
+
+        private AdvancedSerialMessage[] Held = new AdvancedSerialMessage[MAX_WINDOW_SIZE];
+        private byte ReceiveSequence;
+
+        private MemoryStream Assembly = new MemoryStream();
+        private int AssemblyIndex = -1;
+        private byte AcceptedBaud = NO_BAUD;
+
+        private Dictionary<byte, AdvancedSerialMessage> References = new Dictionary<byte, AdvancedSerialMessage>();
+
+        /// <summary>
+        /// Link options currently in use.
+        /// </summary>
+        public byte LinkOptions
+        {
+            get { return this.Options; }
+        }
+
+        /// <summary>
+        /// Negotiate link options with the device.
+        /// </summary>
+        /// <param name="Options">Requested options, only those in SUPPORTED_OPTIONS are asked for.</param>
+        /// <returns>Options accepted by the device.</returns>
+        public byte Setup(byte Options)
+        {
+            this.Send(MessageTypes.SETUP_REQUEST, 0, 2, new byte[] { (byte)(Options & SUPPORTED_OPTIONS), (byte)MAX_WINDOW_SIZE });
+            return this.Options;
+        }
+
+        /// <summary>
+        /// Fastest rate both the device and the transport can run at.
+        /// </summary>
+        public int FastestBaudRate
+        {
+            get
+            {
+                for (int Code = BAUD_RATES.Length - 1; Code >= 0; Code--)
+                {
+                    if ((this.DeviceCapabilities.BaudRates & (1 << Code)) != 0)
+                        return Math.Max(BAUD_RATES[Code], this.BaudRate);
+                }
+                return this.BaudRate;
+            }
+        }
+
+        /// <summary>
+        /// Negotiate link options with the device and switch both ends to another rate.
+        /// </summary>
+        /// <param name="Options">Requested options, only those in SUPPORTED_OPTIONS are asked for.</param>
+        /// <param name="BaudRate">Requested rate, one of BAUD_RATES the device reported.</param>
+        /// <returns>Options accepted by the device.</returns>
+        public byte Setup(byte Options, int BaudRate)
+        {
+            int Code = Array.IndexOf(BAUD_RATES, BaudRate);
+            if (BaudRate == this.BaudRate || Code < 0 || (this.DeviceCapabilities.BaudRates & (1 << Code)) == 0)
+                return this.Setup(Options);
+
+            this.AcceptedBaud = NO_BAUD;
+            this.Send(MessageTypes.SETUP_REQUEST, 0, 3, new byte[] { (byte)(Options & SUPPORTED_OPTIONS), (byte)MAX_WINDOW_SIZE, (byte)Code });
+            if (this.AcceptedBaud != Code)
+                return this.Options;
+
+            //the device changes rate as soon as its response is out, confirm at the new one
+            int Previous = this.BaudRate;
+            int Start = Environment.TickCount;
+            this.BaudRate = BaudRate;
+            try
+            {
+                return this.Setup(this.Options);
+            }
+            catch (TimeoutException)
+            {
+                //the device returns to its initial rate without confirmation, follow it there
+                Thread.Sleep(Math.Max(0, BAUD_FALLBACK_TIMEOUT - (Environment.TickCount - Start)));
+                this.BaudRate = Previous;
+                this.Send(MessageTypes.DISCOVERY_REQUEST);
+                return this.Setup(Options);
+            }
+        }
+
         /// <summary>
         /// Send message.
         /// </summary>
@@ -180,16 +511,23 @@ namespace ebl_arduino
         {
             if (Size >= 0 && Size <= MESSAGE_MAX_PAYLOAD_SIZE)
             {
-                this.ConnectionStream.WriteByte(STX);
-                this.ConnectionStream.WriteByte((byte)Type);
-                this.ConnectionStream.WriteByte(ID);
-                this.ConnectionStream.WriteByte(Size);
-                if (Size > 0) this.ConnectionStream.Write(Payload, 0, Size);
-                this.ConnectionStream.WriteByte(ETX);
+                //discovery resets the device to plain framing
+                if (Type == MessageTypes.DISCOVERY_REQUEST)
+                    this.SetOptions(0);
+
+                if ((Type == MessageTypes.MESSAGE || Type == MessageTypes.FRAGMENT) && (this.Options & OPTION_WINDOW) != 0)
+                {
+                    this.SendWindowed(Type, ID, Size, Payload);
+                    return;
+                }
+
+                this.Write(Type, ID, 0, Size, Payload);
 
                 //wait for confirmations
                 if (Type == MessageTypes.MESSAGE ||
-                    Type == MessageTypes.DISCOVERY_REQUEST)
+                    Type == MessageTypes.FRAGMENT ||
+                    Type == MessageTypes.DISCOVERY_REQUEST ||
+                    Type == MessageTypes.SETUP_REQUEST)
                 {
                     lock (this.ConnectionStream)
                     {
@@ -204,6 +542,376 @@ namespace ebl_arduino
             }
         }
 
+        /// <summary>
+        /// Send a struct laid out as the firmware declares it.
+        /// </summary>
+        /// <typeparam name="T">Struct with [StructLayout(LayoutKind.Sequential, Pack = 1)], matching the packed firmware struct.</typeparam>
+        /// <param name="ID">Message ID.</param>
+        /// <param name="Value">Value to send.</param>
+        public void Send<T>(byte ID, T Value) where T : struct
+        {
+            byte[] Payload = new byte[PayloadSize(typeof(T))];
+            GCHandle Handle = GCHandle.Alloc(Payload, GCHandleType.Pinned);
+
+            try
+            {
+                Marshal.StructureToPtr(Value, Handle.AddrOfPinnedObject(), false);
+            }
+            finally
+            {
+                Handle.Free();
+            }
+            this.Send(MessageTypes.MESSAGE, ID, (byte)Payload.Length, Payload);
+        }
+
+        /// <summary>
+        /// Read a message payload as a struct laid out as the firmware declares it.
+        /// </summary>
+        /// <typeparam name="T">Struct with [StructLayout(LayoutKind.Sequential, Pack = 1)], matching the packed firmware struct.</typeparam>
+        /// <param name="Message">Received message.</param>
+        /// <returns>Decoded value.</returns>
+        public static T Decode<T>(AdvancedSerialMessage Message) where T : struct
+        {
+            if (Message.Size != PayloadSize(typeof(T)))
+                throw new ArgumentException("Payload size " + Message.Size + " does not match " + typeof(T).Name + ".");
+
+            GCHandle Handle = GCHandle.Alloc(Message.Payload, GCHandleType.Pinned);
+            try
+            {
+                return (T)Marshal.PtrToStructure(Handle.AddrOfPinnedObject(), typeof(T));
+            }
+            finally
+            {
+                Handle.Free();
+            }
+        }
+
+        /// <summary>
+        /// Size of a typed payload, checking it has the firmware layout.
+        /// </summary>
+        private static int PayloadSize(Type Payload)
+        {
+            //fields go out as they sit in memory, little-endian like the AVR
+            if (!BitConverter.IsLittleEndian)
+                throw new NotSupportedException("Typed payloads need a little-endian host.");
+            if (Payload.StructLayoutAttribute == null || Payload.StructLayoutAttribute.Value == LayoutKind.Auto ||
+                Payload.StructLayoutAttribute.Pack != 1)
+                throw new ArgumentException(Payload.Name + " must be declared [StructLayout(LayoutKind.Sequential, Pack = 1)].");
+
+            int Size = Marshal.SizeOf(Payload);
+            if (Size > MESSAGE_MAX_PAYLOAD_SIZE)
+                throw new ArgumentException(Payload.Name + " is larger than " + MESSAGE_MAX_PAYLOAD_SIZE + " bytes.");
+            return Size;
+        }
+
+        /// <summary>
+        /// Ask the device for its link counters, answered through StatisticsReceived.
+        /// </summary>
+        /// <param name="First">First counter wanted, the device sends as many as fit in one message.</param>
+        public void RequestStatistics(byte First)
+        {
+            this.Write(MessageTypes.DEBUG, First, 0, 0, null);
+        }
+
+        /// <summary>
+        /// Send data larger than one message as a run of fragments.
+        /// </summary>
+        /// <param name="ID">Message ID.</param>
+        /// <param name="Data">Data to send, up to 255 fragments.</param>
+        public void SendBulk(byte ID, byte[] Data)
+        {
+            int Count = Math.Max((Data.Length + FRAGMENT_DATA_SIZE - 1) / FRAGMENT_DATA_SIZE, 1);
+            if (Count > 255)
+                throw new ArgumentException("Bulk message limited to " + (255 * FRAGMENT_DATA_SIZE) + " bytes.");
+
+            for (int Index = 0; Index < Count; Index++)
+            {
+                int Offset = Index * FRAGMENT_DATA_SIZE;
+                int Length = Math.Min(Data.Length - Offset, FRAGMENT_DATA_SIZE);
+                byte[] Fragment = new byte[FRAGMENT_HEADER_SIZE + Length];
+
+                Fragment[0] = (byte)Index;
+                Fragment[1] = (byte)Count;
+                Array.Copy(Data, Offset, Fragment, FRAGMENT_HEADER_SIZE, Length);
+                this.Send(MessageTypes.FRAGMENT, ID, (byte)Fragment.Length, Fragment);
+            }
+        }
+
+        /// <summary>
+        /// Queue message in the transmit window, blocking only while the window is full.
+        /// </summary>
+        private void SendWindowed(MessageTypes Type, byte ID, byte Size, byte[] Payload)
+        {
+            AdvancedSerialMessage Message = new AdvancedSerialMessage();
+            Message.Type = Type;
+            Message.ID = ID;
+            Message.Size = Size;
+            Message.Payload = new byte[Size];
+            if (Size > 0) Array.Copy(Payload, Message.Payload, Size);
+
+            lock (this.WindowLock)
+            {
+                while (this.WindowCount >= Math.Min(this.WindowLimit, MAX_WINDOW_SIZE))
+                {
+                    if (!Monitor.Wait(this.WindowLock, this.MessageTimeout))
+                        throw new TimeoutException("Device not responding.");
+                }
+
+                Message.Sequence = (byte)(this.WindowBase + this.WindowCount);
+                this.Window[Message.Sequence % MAX_WINDOW_SIZE] = Message;
+                this.WindowTicks[Message.Sequence % MAX_WINDOW_SIZE] = Environment.TickCount;
+                this.WindowCount++;
+
+                this.Write(Message.Type, Message.ID, Message.Sequence, Message.Size, Message.Payload);
+            }
+        }
+
+        /// <summary>
+        /// Write one frame to the stream.
+        /// </summary>
+        private void Write(MessageTypes Type, byte ID, byte Sequence, byte Size, byte[] Payload)
+        {
+            //discovery is always a bare frame
+            int HeaderSize = (Type == MessageTypes.DISCOVERY_REQUEST) ? MESSAGE_HEADER_SIZE : this.HeaderSize;
+            byte[] Frame = new byte[MESSAGE_DELIMITER_SIZE + HeaderSize + Size + MESSAGE_DELIMITER_SIZE];
+
+            Frame[0] = STX;
+            Frame[1] = (byte)Type;
+            Frame[2] = ID;
+            Frame[3] = Size;
+            if (HeaderSize > MESSAGE_HEADER_SIZE) Frame[4] = Sequence;
+            if (Size > 0) Array.Copy(Payload, 0, Frame, MESSAGE_DELIMITER_SIZE + HeaderSize, Size);
+            Frame[Frame.Length - 1] = ETX;
+
+            lock (this.WriteLock)
+            {
+                this.ConnectionStream.Write(Frame, 0, Frame.Length);
+            }
+        }
+
+        /// <summary>
+        /// Switch link options, both ends restart sequence numbers from zero.
+        /// </summary>
+        private void SetOptions(byte Options)
+        {
+            lock (this.WindowLock)
+            {
+                this.Options = Options;
+                this.HeaderSize = MESSAGE_HEADER_SIZE + (((Options & OPTION_WINDOW) != 0) ? SEQUENCE_SIZE : 0);
+                this.WindowBase = 0;
+                this.WindowCount = 0;
+                this.WindowAcknowledged = 0;
+                this.WindowLimit = 1;
+                this.ReceiveSequence = 0;
+                Array.Clear(this.Window, 0, MAX_WINDOW_SIZE);
+                Array.Clear(this.Held, 0, MAX_WINDOW_SIZE);
+                this.AssemblyIndex = -1;
+                this.References.Clear();
+
+                if ((Options & OPTION_WINDOW) != 0 && this.RetransmitTimer == null)
+                    this.RetransmitTimer = new Timer(new TimerCallback(Retransmit), null, this.RetransmitTimeout / 2, this.RetransmitTimeout / 2);
+
+                Monitor.PulseAll(this.WindowLock);
+            }
+        }
+
+        /// <summary>
+        /// Resend messages not acknowledged within RetransmitTimeout.
+        /// </summary>
+        private void Retransmit(object State)
+        {
+            try
+            {
+                lock (this.WindowLock)
+                {
+                    for (int i = 0; i < this.WindowCount; i++)
+                    {
+                        int Slot = (byte)(this.WindowBase + i) % MAX_WINDOW_SIZE;
+                        if ((this.WindowAcknowledged & (1 << i)) != 0 ||
+                            Environment.TickCount - this.WindowTicks[Slot] < this.RetransmitTimeout)
+                            continue;
+
+                        AdvancedSerialMessage Message = this.Window[Slot];
+                        this.WindowTicks[Slot] = Environment.TickCount;
+                        this.Write(Message.Type, Message.ID, Message.Sequence, Message.Size, Message.Payload);
+                    }
+                }
+            }
+            catch (Exception)
+            {
+                this.Close();
+            }
+        }
+
+        /// <summary>
+        /// Apply a cumulative and selective acknowledge from the device.
+        /// </summary>
+        private void Acknowledged(AdvancedSerialMessage Message)
+        {
+            lock (this.WindowLock)
+            {
+                //everything before the cumulative sequence is delivered
+                int Done = (byte)(Message.ID - this.WindowBase);
+                if (Done > this.WindowCount)
+                    return;
+
+                this.WindowBase = Message.ID;
+                this.WindowCount -= Done;
+                this.WindowAcknowledged >>= Done;
+
+                if (Message.Size > 0)
+                    this.WindowAcknowledged |= (Message.Payload[0] << 1) & ((1 << this.WindowCount) - 1);
+                if (Message.Size > 1)
+                    this.WindowLimit = Message.Payload[1];
+
+                //a rejected frame is resent at once instead of waiting for the timeout
+                if (Message.Type == MessageTypes.MESSAGE_NEGATIVE_ACKNOWLEDGE && this.WindowCount > 0)
+                    this.WindowTicks[this.WindowBase % MAX_WINDOW_SIZE] = Environment.TickCount - this.RetransmitTimeout;
+
+                Monitor.PulseAll(this.WindowLock);
+            }
+        }
+
+        /// <summary>
+        /// Hold a windowed message until every earlier sequence has arrived, then deliver in order.
+        /// </summary>
+        private void ReceivedWindowed(AdvancedSerialMessage Message)
+        {
+            int Offset = (byte)(Message.Sequence - this.ReceiveSequence);
+            int Bitmap = 0;
+
+            if (Offset < MAX_WINDOW_SIZE && this.Held[Message.Sequence % MAX_WINDOW_SIZE] == null)
+            {
+                AdvancedSerialMessage Copy = new AdvancedSerialMessage();
+                Copy.Type = Message.Type;
+                Copy.ID = Message.ID;
+                Copy.Size = Message.Size;
+                Copy.Sequence = Message.Sequence;
+                Copy.Payload = new byte[Message.Size];
+                Array.Copy(Message.Payload, Copy.Payload, Message.Size);
+                this.Held[Message.Sequence % MAX_WINDOW_SIZE] = Copy;
+            }
+
+            while (this.Held[this.ReceiveSequence % MAX_WINDOW_SIZE] != null)
+            {
+                AdvancedSerialMessage Next = this.Held[this.ReceiveSequence % MAX_WINDOW_SIZE];
+                this.Held[this.ReceiveSequence % MAX_WINDOW_SIZE] = null;
+                this.ReceiveSequence++;
+                this.Deliver(Next);
+            }
+
+            for (int i = 0; i < MAX_WINDOW_SIZE - 1; i++)
+            {
+                if (this.Held[(byte)(this.ReceiveSequence + 1 + i) % MAX_WINDOW_SIZE] != null)
+                    Bitmap |= 1 << i;
+            }
+            this.Write(MessageTypes.MESSAGE_ACKNOWLEDGE, this.ReceiveSequence, 0, 2, new byte[] { (byte)Bitmap, (byte)MAX_WINDOW_SIZE });
+        }
+
+        /// <summary>
+        /// Hand a message to the application, collecting fragments until the bulk message is complete.
+        /// </summary>
+        private void Deliver(AdvancedSerialMessage Message)
+        {
+            if (Message.Type == MessageTypes.COMPRESSED)
+            {
+                this.Decompress(Message);
+                return;
+            }
+
+            if (Message.Type != MessageTypes.FRAGMENT)
+            {
+                if (this.MessageReceived != null)
+                    this.MessageReceived(Message);
+                return;
+            }
+
+            if (Message.Size < FRAGMENT_HEADER_SIZE)
+                return;
+
+            //the link delivers in order, a first fragment always starts over
+            int Index = Message.Payload[0];
+            int Count = Message.Payload[1];
+            if (Index == 0)
+            {
+                this.Assembly.SetLength(0);
+                this.AssemblyIndex = 0;
+            }
+            if (Index != this.AssemblyIndex || Index >= Count)
+            {
+                this.AssemblyIndex = -1;
+                return;
+            }
+
+            this.Assembly.Write(Message.Payload, FRAGMENT_HEADER_SIZE, Message.Size - FRAGMENT_HEADER_SIZE);
+            this.AssemblyIndex++;
+
+            if (this.AssemblyIndex == Count)
+            {
+                this.AssemblyIndex = -1;
+                if (this.BulkReceived != null)
+                    this.BulkReceived(Message.ID, this.Assembly.ToArray());
+            }
+        }
+
+        /// <summary>
+        /// Rebuild a compressed message from the previous one with the same ID and deliver it as MESSAGE.
+        /// </summary>
+        private void Decompress(AdvancedSerialMessage Message)
+        {
+            if (Message.Size < COMPRESSED_HEADER_SIZE)
+                return;
+
+            bool Keyframe = (Message.Payload[0] & 0x80) != 0;
+            byte Counter = (byte)(Message.Payload[0] & 0x7F);
+            AdvancedSerialMessage Reference;
+            this.References.TryGetValue(Message.ID, out Reference);
+
+            //a delta only applies on top of the message right before it, after a loss wait for a keyframe
+            if (!Keyframe && (Reference == null || Counter != ((Reference.Sequence + 1) & 0x7F)))
+            {
+                this.References.Remove(Message.ID);
+                return;
+            }
+
+            //0x80|n stands for n+1 zero bytes, n below 0x80 for the n+1 literal bytes after it
+            byte[] Decoded = new byte[MESSAGE_MAX_PAYLOAD_SIZE];
+            int Length = 0;
+            for (int i = COMPRESSED_HEADER_SIZE; i < Message.Size; )
+            {
+                int Count = (Message.Payload[i] & 0x7F) + 1;
+                bool Run = (Message.Payload[i++] & 0x80) != 0;
+                if (Length + Count > Decoded.Length || (!Run && i + Count > Message.Size))
+                {
+                    this.References.Remove(Message.ID);
+                    return;
+                }
+                if (!Run)
+                {
+                    Array.Copy(Message.Payload, i, Decoded, Length, Count);
+                    i += Count;
+                }
+                Length += Count;
+            }
+            if (!Keyframe && Length != Reference.Size)
+            {
+                this.References.Remove(Message.ID);
+                return;
+            }
+
+            AdvancedSerialMessage Plain = new AdvancedSerialMessage();
+            Plain.ID = Message.ID;
+            Plain.Size = (byte)Length;
+            Plain.Sequence = Counter;
+            Plain.Payload = new byte[Length];
+            for (int i = 0; i < Length; i++)
+                Plain.Payload[i] = (byte)(Keyframe ? Decoded[i] : Decoded[i] ^ Reference.Payload[i]);
+            this.References[Message.ID] = Plain;
+
+            if (this.MessageReceived != null)
+                this.MessageReceived(Plain);
+        }
+
         /// <summary>
         /// Send simple message without payload.
         /// </summary>
@@ -252,6 +960,11 @@ namespace ebl_arduino
                         this.RequestedBytes = MESSAGE_HEADER_SIZE;
                         break;
 
+                    case ConnectionState.ReadingSequence:
+                        this.ConnectionStream.BeginRead(this.InputBuffer, 0, SEQUENCE_SIZE, this.DataReceivingCallback, null);
+                        this.RequestedBytes = SEQUENCE_SIZE;
+                        break;
+
                     case ConnectionState.ReadingPayload:
                         this.ConnectionStream.BeginRead(this.InputBuffer, 0, this.InputMessage.Size, this.DataReceivingCallback, null);
                         this.RequestedBytes = this.InputMessage.Size;
@@ -304,8 +1017,15 @@ namespace ebl_arduino
 
                 case ConnectionState.ReadingHeader:
                     this.InputMessage.Type = (MessageTypes)this.InputBuffer[0];
-                    this.InputMessage.Size = this.InputBuffer[1];
-                    if (this.InputMessage.Size == 0)
+                    this.InputMessage.ID = this.InputBuffer[1];
+                    this.InputMessage.Size = this.InputBuffer[2];
+                    this.InputMessage.Sequence = 0;
+                    if (this.HeaderSize > MESSAGE_HEADER_SIZE && this.InputMessage.Type != MessageTypes.DISCOVERY_RESPONSE)
+                    {
+                        //sequence number follows
+                        this.State = ConnectionState.ReadingSequence;
+                    }
+                    else if (this.InputMessage.Size == 0)
                     {
                         //payload is empty
                         this.State = ConnectionState.ReadingETX;
@@ -322,7 +1042,18 @@ namespace ebl_arduino
                     }
                     break;
 
+                case ConnectionState.ReadingSequence:
+                    this.InputMessage.Sequence = this.InputBuffer[0];
+                    if (this.InputMessage.Size == 0)
+                        this.State = ConnectionState.ReadingETX;
+                    else if (this.InputMessage.Size <= MESSAGE_MAX_PAYLOAD_SIZE)
+                        this.State = ConnectionState.ReadingPayload;
+                    else
+                        this.State = ConnectionState.ReadingSTX;
+                    break;
+
                 case ConnectionState.ReadingPayload:
+                    this.InputMessage.Payload = new byte[this.InputMessage.Size];
                     Array.Copy(this.InputBuffer, this.InputMessage.Payload, this.InputMessage.Size);
                     this.State = ConnectionState.ReadingETX;
                     break;
@@ -330,7 +1061,46 @@ namespace ebl_arduino
                 case ConnectionState.ReadingETX:
                     if (this.InputDelimiter[0] == ETX)
                     {
-                        if (this.InputMessage.Type == MessageTypes.DISCOVERY_RESPONSE ||
+                        if (this.InputMessage.Size == 0)
+                            this.InputMessage.Payload = new byte[0];
+
+                        if (this.InputMessage.Type == MessageTypes.SETUP_RESPONSE && this.InputMessage.Size > 0)
+                        {
+                            //the device has switched, follow it
+                            this.SetOptions((byte)(this.InputMessage.Payload[0] & SUPPORTED_OPTIONS));
+                            if (this.InputMessage.Size > 1)
+                                this.WindowLimit = this.InputMessage.Payload[1];
+                            this.AcceptedBaud = (this.InputMessage.Size > 2) ? this.InputMessage.Payload[2] : NO_BAUD;
+                        }
+
+                        if (this.InputMessage.Type == MessageTypes.DISCOVERY_RESPONSE)
+                        {
+                            Capabilities Description = new Capabilities();
+                            if (this.InputMessage.Size >= CAPABILITY_SIZE)
+                            {
+                                Description.Version = this.InputMessage.Payload[0];
+                                Description.MaxPayloadSize = this.InputMessage.Payload[1];
+                                Description.Options = this.InputMessage.Payload[2];
+                                Description.BaudRates = this.InputMessage.Payload[3];
+                            }
+                            this.DeviceCapabilities = Description;
+                        }
+
+                        if ((this.Options & OPTION_WINDOW) != 0 &&
+                            (this.InputMessage.Type == MessageTypes.MESSAGE_ACKNOWLEDGE ||
+                             this.InputMessage.Type == MessageTypes.MESSAGE_NEGATIVE_ACKNOWLEDGE))
+                        {
+                            this.Acknowledged(this.InputMessage);
+                        }
+                        else if ((this.Options & OPTION_WINDOW) != 0 &&
+                            (this.InputMessage.Type == MessageTypes.MESSAGE ||
+                             this.InputMessage.Type == MessageTypes.FRAGMENT ||
+                             this.InputMessage.Type == MessageTypes.COMPRESSED))
+                        {
+                            this.ReceivedWindowed(this.InputMessage);
+                        }
+                        else if (this.InputMessage.Type == MessageTypes.DISCOVERY_RESPONSE ||
+                            this.InputMessage.Type == MessageTypes.SETUP_RESPONSE ||
                             this.InputMessage.Type == MessageTypes.MESSAGE_ACKNOWLEDGE)
                         {
                             lock (this.ConnectionStream)
@@ -338,15 +1108,27 @@ namespace ebl_arduino
                                 Monitor.Pulse(this.ConnectionStream);
                             }
                         }
-                        else if (this.InputMessage.Type == MessageTypes.MESSAGE)
+                        else if (this.InputMessage.Type == MessageTypes.MESSAGE ||
+                            this.InputMessage.Type == MessageTypes.FRAGMENT ||
+                            this.InputMessage.Type == MessageTypes.COMPRESSED)
                         {
                             this.Send(MessageTypes.MESSAGE_ACKNOWLEDGE);
-                            this.MessageReceived(this.InputMessage);
+                            this.Deliver(this.InputMessage);
                         }
                         else if (this.InputMessage.Type == MessageTypes.DISCOVERY_REQUEST)
                         {
                             this.Send(MessageTypes.DISCOVERY_RESPONSE);
                         }
+                        else if (this.InputMessage.Type == MessageTypes.DEBUG)
+                        {
+                            //counters are sent high byte first
+                            uint[] Counters = new uint[this.InputMessage.Size / 4];
+                            for (int i = 0; i < Counters.Length; i++)
+                                Counters[i] = (uint)(this.InputMessage.Payload[i * 4] << 24 | this.InputMessage.Payload[i * 4 + 1] << 16 |
+                                    this.InputMessage.Payload[i * 4 + 2] << 8 | this.InputMessage.Payload[i * 4 + 3]);
+                            if (this.StatisticsReceived != null)
+                                this.StatisticsReceived(this.InputMessage.ID, Counters);
+                        }
                     }
 
                     this.State = ConnectionState.ReadingSTX;
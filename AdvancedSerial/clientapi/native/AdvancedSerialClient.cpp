@@ -0,0 +1,931 @@
+/*
+  AdvancedSerialClient.cpp - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "AdvancedSerialClient.h"
+#include "AdvancedSerialPoller.h"
+
+namespace ebl_arduino {
+
+#define DELIMITER_STX 0x02
+#define DELIMITER_ETX 0x03
+#define DELIMITER_ESC 0x10
+#define ESCAPE_MASK 0x20
+
+#define CHECKSUM_POLYNOMIAL 0x1021
+#define CHECKSUM_INITIAL 0xFFFF
+
+#define READ_BUFFER_SIZE 4096
+//longest frame on the wire, every byte after STX escaped
+#define MAX_ENCODED_SIZE (2*(AdvancedSerialClient::MESSAGE_HEADER_SIZE+AdvancedSerialClient::SEQUENCE_SIZE+MESSAGE_MAX_PAYLOAD_SIZE+AdvancedSerialClient::CHECKSUM_SIZE)+2)
+#define FRAGMENT_DATA_SIZE (MESSAGE_MAX_PAYLOAD_SIZE-AdvancedSerialClient::FRAGMENT_HEADER_SIZE)
+
+static uint16_t checksumTable[256];
+
+static void buildChecksumTable() {
+	uint16_t crc;
+
+	if (checksumTable[1] != 0)
+		return;
+	for (int i = 0; i < 256; i++) {
+		crc = i << 8;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ CHECKSUM_POLYNOMIAL : crc << 1;
+		checksumTable[i] = crc;
+	}
+}
+
+static inline uint16_t updateChecksum(uint16_t checksum, byte data) {
+	return (checksum << 8) ^ checksumTable[(checksum >> 8) ^ data];
+}
+
+static unsigned long millis() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long)now.tv_sec*1000UL + now.tv_nsec/1000000;
+}
+
+//rates a SETUP_REQUEST may switch to, by code
+static const int baudRates[AdvancedSerialClient::BAUD_RATES] = {
+	9600, 19200, 38400, 57600, 115200, 250000, 500000, 1000000
+};
+
+static speed_t baudConstant(int baud) {
+	switch (baud) {
+		case 1200: return B1200;
+		case 2400: return B2400;
+		case 4800: return B4800;
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+		case 460800: return B460800;
+		case 500000: return B500000;
+		case 1000000: return B1000000;
+		default: return B0;
+	}
+}
+
+AdvancedSerialClient::AdvancedSerialClient() : input(READ_BUFFER_SIZE) {
+	buildChecksumTable();
+	this->fd = -1;
+	this->owned = false;
+	this->poller = NULL;
+	this->inputSize = 0;
+	this->outputHead = 0;
+	this->switching = false;
+	this->baud = 0;
+	this->previousBaud = 0;
+	this->requestedBaud = 0;
+	memset(&this->capabilities, 0, sizeof(this->capabilities));
+	this->watchingWrite = false;
+	this->retransmitTimeout = 250;
+	this->retransmitted = 0;
+	this->onReceive = NULL;
+	this->onBulkReceive = NULL;
+	this->onLink = NULL;
+	this->onStatistics = NULL;
+	this->context = NULL;
+	this->setOptions(0);
+}
+
+AdvancedSerialClient::~AdvancedSerialClient() {
+	this->close();
+}
+
+bool AdvancedSerialClient::open(const char* path, int baud) {
+	struct termios settings;
+	speed_t speed = baudConstant(baud);
+	int fd;
+
+	if (speed == B0)
+		return false;
+	fd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0)
+		return false;
+
+	//raw 8N1, no flow control
+	if (tcgetattr(fd, &settings) < 0) {
+		::close(fd);
+		return false;
+	}
+	cfmakeraw(&settings);
+	cfsetispeed(&settings, speed);
+	cfsetospeed(&settings, speed);
+	settings.c_cflag |= CLOCAL | CREAD;
+	settings.c_cflag &= ~CRTSCTS;
+	if (tcsetattr(fd, TCSANOW, &settings) < 0) {
+		::close(fd);
+		return false;
+	}
+	tcflush(fd, TCIOFLUSH);
+
+	this->attach(fd, baud);
+	this->owned = true;
+	return true;
+}
+
+void AdvancedSerialClient::attach(int fd, int baud) {
+	this->close();
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	this->fd = fd;
+	this->owned = false;
+	this->inputSize = 0;
+	this->output.clear();
+	this->outputHead = 0;
+	this->queued.clear();
+	this->inFlight.clear();
+	this->switching = false;
+	this->baud = baud;
+	this->previousBaud = 0;
+	this->requestedBaud = 0;
+	memset(&this->capabilities, 0, sizeof(this->capabilities));
+	this->setOptions(0);
+}
+
+void AdvancedSerialClient::close() {
+	if (this->fd < 0)
+		return;
+	if (this->poller != NULL)
+		this->poller->remove(this);
+	if (this->owned)
+		::close(this->fd);
+	this->fd = -1;
+}
+
+int AdvancedSerialClient::descriptor() const {
+	return this->fd;
+}
+
+bool AdvancedSerialClient::isOpen() const {
+	return this->fd >= 0;
+}
+
+void AdvancedSerialClient::setReceiver(void (*onReceive)(AdvancedSerialClient* client, const AdvancedSerialMessage* message, void* context), void* context) {
+	this->onReceive = onReceive;
+	this->context = context;
+}
+
+void AdvancedSerialClient::setBulkReceiver(void (*onBulkReceive)(AdvancedSerialClient* client, byte id, const byte* data, size_t size, void* context)) {
+	this->onBulkReceive = onBulkReceive;
+}
+
+void AdvancedSerialClient::setLinkReceiver(void (*onLink)(AdvancedSerialClient* client, byte type, void* context)) {
+	this->onLink = onLink;
+}
+
+void AdvancedSerialClient::setStatisticsReceiver(void (*onStatistics)(AdvancedSerialClient* client, byte first, const unsigned long* counters, byte count, void* context)) {
+	this->onStatistics = onStatistics;
+}
+
+void AdvancedSerialClient::requestStatistics(byte first) {
+	//answered with as many counters from first on as fit in one frame
+	this->transmit(DEBUG, first, 0, 0, NULL);
+	this->flush();
+}
+
+byte AdvancedSerialClient::getOptions() const {
+	return this->options;
+}
+
+const AdvancedSerialCapabilities& AdvancedSerialClient::getCapabilities() const {
+	return this->capabilities;
+}
+
+int AdvancedSerialClient::getBaud() const {
+	return this->baud;
+}
+
+int AdvancedSerialClient::fastestBaud() const {
+	//only a port with a known rate can follow the board, and only to a rate termios knows
+	if (this->baud == 0)
+		return 0;
+	for (int code = BAUD_RATES-1; code >= 0; code--) {
+		if ((this->capabilities.bauds & (1 << code)) && baudConstant(baudRates[code]) != B0)
+			return baudRates[code] > this->baud ? baudRates[code] : this->baud;
+	}
+	return this->baud;
+}
+
+bool AdvancedSerialClient::setSpeed(int baud) {
+	struct termios settings;
+	speed_t speed = baudConstant(baud);
+
+	//whatever was written still goes out at the old rate
+	this->flush();
+	tcdrain(this->fd);
+	if (speed == B0 || tcgetattr(this->fd, &settings) < 0)
+		return false;
+	cfsetispeed(&settings, speed);
+	cfsetospeed(&settings, speed);
+	if (tcsetattr(this->fd, TCSANOW, &settings) < 0)
+		return false;
+	this->baud = baud;
+	return true;
+}
+
+void AdvancedSerialClient::confirmBaud() {
+	byte request[2];
+
+	//any good frame at the new rate keeps the board there
+	request[0] = this->requestedOptions;
+	request[1] = MAX_WINDOW_SIZE;
+	this->transmit(SETUP_REQUEST, 0, 0, 2, request);
+	this->switchMillis = millis();
+	this->flush();
+}
+
+size_t AdvancedSerialClient::pending() const {
+	return this->queued.size()+this->inFlight.size();
+}
+
+void AdvancedSerialClient::setOptions(byte options) {
+	this->options = options;
+	this->headerSize = MESSAGE_HEADER_SIZE + ((options & OPTION_WINDOW) ? SEQUENCE_SIZE : 0);
+	this->windowSequence = 0;
+	this->windowLimit = 1;
+	this->receiveSequence = 0;
+	this->assemblyIndex = -1;
+	for (int i = 0; i < MAX_WINDOW_SIZE; i++)
+		this->held[i].present = false;
+
+	//the board starts over with keyframes
+	this->references.clear();
+
+	//the board drops whatever was in flight, send it again in the new framing
+	while (!this->inFlight.empty()) {
+		this->queued.push_front(this->inFlight.back());
+		this->inFlight.pop_back();
+	}
+}
+
+void AdvancedSerialClient::discover() {
+	//the board answers a bare discovery whatever options it was left in
+	this->switching = false;
+	this->setOptions(0);
+	this->transmit(DISCOVERY_REQUEST, 0, 0, 0, NULL);
+	this->flush();
+}
+
+void AdvancedSerialClient::setup(byte options, int baud) {
+	byte request[3];
+	byte size = 2;
+
+	request[0] = options & SUPPORTED_OPTIONS;
+	request[1] = MAX_WINDOW_SIZE;
+
+	//a rate change is only asked for when both ends can make it
+	this->requestedBaud = 0;
+	if (baud != 0 && baud != this->baud && this->baud != 0 && baudConstant(baud) != B0) {
+		for (int code = 0; code < BAUD_RATES; code++) {
+			if (baudRates[code] == baud && (this->capabilities.bauds & (1 << code))) {
+				request[size++] = code;
+				this->requestedBaud = baud;
+			}
+		}
+	}
+	this->transmit(SETUP_REQUEST, 0, 0, size, request);
+
+	//hold further frames until the board confirms, they would arrive in the wrong framing
+	this->switching = true;
+	this->requestedOptions = request[0];
+	this->switchMillis = millis();
+	this->flush();
+}
+
+bool AdvancedSerialClient::send(byte id, byte size, const byte* payload) {
+	if (size > MESSAGE_MAX_PAYLOAD_SIZE)
+		return false;
+	this->queue(MESSAGE, id, size, payload);
+	this->pump();
+	this->flush();
+	return true;
+}
+
+bool AdvancedSerialClient::sendBulk(byte id, const byte* data, size_t size) {
+	byte fragment[MESSAGE_MAX_PAYLOAD_SIZE];
+	size_t count = (size+FRAGMENT_DATA_SIZE-1) / FRAGMENT_DATA_SIZE;
+	size_t offset, length;
+
+	if (count > 255)
+		return false;
+	if (count == 0)
+		count = 1;
+
+	for (size_t index = 0; index < count; index++) {
+		offset = index*FRAGMENT_DATA_SIZE;
+		length = (size-offset > FRAGMENT_DATA_SIZE) ? FRAGMENT_DATA_SIZE : size-offset;
+		fragment[0] = index;
+		fragment[1] = count;
+		memcpy(fragment+FRAGMENT_HEADER_SIZE, data+offset, length);
+		this->queue(FRAGMENT, id, length+FRAGMENT_HEADER_SIZE, fragment);
+	}
+	this->pump();
+	this->flush();
+	return true;
+}
+
+void AdvancedSerialClient::queue(byte type, byte id, byte size, const byte* payload) {
+	Outgoing message;
+
+	message.type = type;
+	message.id = id;
+	message.size = size;
+	if (size > 0)
+		memcpy(message.payload, payload, size);
+	this->queued.push_back(message);
+}
+
+void AdvancedSerialClient::pump() {
+	size_t limit = 1;
+	unsigned long now = millis();
+
+	if (this->switching || this->fd < 0)
+		return;
+
+	if (this->options & OPTION_WINDOW) {
+		limit = (this->windowLimit < MAX_WINDOW_SIZE) ? this->windowLimit : MAX_WINDOW_SIZE;
+		//probe a closed window with one frame so a lost window update cannot stall the link
+		if (limit == 0 && this->inFlight.empty())
+			limit = 1;
+	}
+
+	//pipeline up to the window, without windowing one message waits for its acknowledge
+	while (!this->queued.empty() && this->inFlight.size() < limit) {
+		Outgoing& message = this->queued.front();
+		message.sequence = this->windowSequence++;
+		message.sentMillis = now;
+		message.acknowledged = false;
+		this->transmit(message.type, message.id, message.sequence, message.size, message.payload);
+		this->inFlight.push_back(message);
+		this->queued.pop_front();
+	}
+}
+
+void AdvancedSerialClient::encode(byte data) {
+	if ((this->options & OPTION_STUFFING) && (data == DELIMITER_STX || data == DELIMITER_ETX || data == DELIMITER_ESC)) {
+		this->output.push_back(DELIMITER_ESC);
+		this->output.push_back(data ^ ESCAPE_MASK);
+	} else {
+		this->output.push_back(data);
+	}
+}
+
+void AdvancedSerialClient::transmit(byte type, byte id, byte sequence, byte size, const byte* payload) {
+	byte header[MESSAGE_HEADER_SIZE+SEQUENCE_SIZE];
+	uint16_t checksum = CHECKSUM_INITIAL;
+
+	header[0] = type;
+	header[1] = id;
+	header[2] = size;
+	header[3] = sequence;
+
+	this->output.push_back(DELIMITER_STX);
+	for (int i = 0; i < this->headerSize; i++) {
+		checksum = updateChecksum(checksum, header[i]);
+		this->encode(header[i]);
+	}
+	for (int i = 0; i < size; i++) {
+		checksum = updateChecksum(checksum, payload[i]);
+		this->encode(payload[i]);
+	}
+	if (this->options & OPTION_CHECKSUM) {
+		this->encode(checksum >> 8);
+		this->encode(checksum & 0xFF);
+	}
+	this->output.push_back(DELIMITER_ETX);
+}
+
+bool AdvancedSerialClient::wantsWrite() const {
+	return this->outputHead < this->output.size();
+}
+
+void AdvancedSerialClient::flush() {
+	ssize_t written;
+
+	while (this->fd >= 0 && this->outputHead < this->output.size()) {
+		written = ::write(this->fd, &this->output[this->outputHead], this->output.size()-this->outputHead);
+		if (written > 0) {
+			this->outputHead += written;
+		} else if (written < 0 && errno == EINTR) {
+			continue;
+		} else if (written < 0 && errno != EAGAIN) {
+			this->close();
+			return;
+		} else {
+			break;
+		}
+	}
+
+	if (this->outputHead == this->output.size()) {
+		this->output.clear();
+		this->outputHead = 0;
+	}
+
+	//ask for EPOLLOUT only while something is left
+	if (this->poller != NULL && this->watchingWrite != this->wantsWrite())
+		this->poller->update(this);
+}
+
+void AdvancedSerialClient::writable() {
+	this->flush();
+}
+
+void AdvancedSerialClient::readable() {
+	ssize_t received;
+	size_t consumed;
+
+	while (this->fd >= 0) {
+		received = ::read(this->fd, &this->input[this->inputSize], this->input.size()-this->inputSize);
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received < 0 && errno == EAGAIN)
+			break;
+		if (received <= 0) {
+			//hang up, or the board went away
+			this->close();
+			return;
+		}
+
+		//frames are handled where they were read, only a partial tail is moved
+		this->inputSize += received;
+		consumed = this->parse(&this->input[0], this->inputSize);
+		this->inputSize -= consumed;
+		if (this->inputSize > 0 && consumed > 0)
+			memmove(&this->input[0], &this->input[consumed], this->inputSize);
+	}
+
+	this->pump();
+	this->flush();
+}
+
+size_t AdvancedSerialClient::parse(byte* data, size_t size) {
+	size_t position = 0;
+	size_t length;
+	byte* start;
+	byte* end;
+	byte* target;
+	bool escaped;
+
+	while (position < size) {
+		start = (byte*)memchr(data+position, DELIMITER_STX, size-position);
+		if (start == NULL)
+			return size;
+		position = start-data;
+
+		if (this->options & OPTION_STUFFING) {
+			//a raw ETX only ever ends a frame
+			end = (byte*)memchr(start+1, DELIMITER_ETX, size-position-1);
+			if (end == NULL) {
+				if (size-position > MAX_ENCODED_SIZE) {
+					position++;
+					continue;
+				}
+				return position;
+			}
+
+			//a raw STX inside means the frame was cut short, start over from it
+			target = (byte*)memchr(start+1, DELIMITER_STX, end-start-1);
+			if (target != NULL) {
+				position = target-data;
+				continue;
+			}
+
+			//unescape in place, the frame only ever shrinks
+			target = start+1;
+			escaped = false;
+			for (byte* source = start+1; source < end; source++) {
+				if (*source == DELIMITER_ESC && !escaped) {
+					escaped = true;
+					continue;
+				}
+				*target++ = escaped ? *source ^ ESCAPE_MASK : *source;
+				escaped = false;
+			}
+			this->frameReceived(start+1, target-start-1);
+			position = end-data+1;
+		} else {
+			if (size-position-1 < (size_t)this->headerSize)
+				return position;
+			if (start[3] > MESSAGE_MAX_PAYLOAD_SIZE) {
+				position++;
+				continue;
+			}
+
+			length = this->headerSize+start[3]+((this->options & OPTION_CHECKSUM) ? CHECKSUM_SIZE : 0);
+			if (size-position-1 < length+1)
+				return position;
+			if (start[1+length] != DELIMITER_ETX) {
+				//not a frame, resynchronize on the next STX
+				position++;
+				continue;
+			}
+			this->frameReceived(start+1, length);
+			position += length+2;
+		}
+	}
+	return position;
+}
+
+bool AdvancedSerialClient::frameReceived(byte* frame, size_t size) {
+	AdvancedSerialMessage message;
+	size_t trailer = (this->options & OPTION_CHECKSUM) ? CHECKSUM_SIZE : 0;
+	uint16_t checksum = CHECKSUM_INITIAL;
+
+	if (size < this->headerSize+trailer || size != this->headerSize+frame[2]+trailer)
+		return false;
+
+	if (trailer > 0) {
+		//trailer included, a good frame leaves a zero remainder
+		for (size_t i = 0; i < size; i++)
+			checksum = updateChecksum(checksum, frame[i]);
+		if (checksum != 0) {
+			this->acknowledge(MESSAGE_NEGATIVE_ACKNOWLEDGE);
+			return false;
+		}
+	}
+
+	message.type = frame[0];
+	message.id = frame[1];
+	message.size = frame[2];
+	message.sequence = (this->headerSize > MESSAGE_HEADER_SIZE) ? frame[MESSAGE_HEADER_SIZE] : 0;
+	message.payload = frame+this->headerSize;
+	this->messageReceived(&message);
+	return true;
+}
+
+void AdvancedSerialClient::messageReceived(const AdvancedSerialMessage* message) {
+	switch (message->type) {
+		case DISCOVERY_REQUEST:
+			this->setOptions(0);
+			this->transmit(DISCOVERY_RESPONSE, 0, 0, 0, NULL);
+			break;
+
+		case SETUP_RESPONSE:
+			//the board has switched, follow it
+			if (message->size > 0 && this->switching) {
+				if (this->requestedBaud != 0 && message->size > 2 && message->payload[2] != NO_BAUD) {
+					//the board changes rate as soon as this response is out, confirm at the new one
+					this->previousBaud = this->baud;
+					this->baudMillis = millis();
+					this->setSpeed(this->requestedBaud);
+					this->requestedBaud = 0;
+					this->requestedOptions &= message->payload[0];
+					this->setOptions(this->requestedOptions);
+					this->confirmBaud();
+					break;
+				}
+				this->switching = false;
+				this->requestedBaud = 0;
+				this->previousBaud = 0;
+				this->setOptions(message->payload[0] & this->requestedOptions);
+				if (message->size > 1)
+					this->windowLimit = message->payload[1];
+				if (this->onLink != NULL)
+					this->onLink(this, message->type, this->context);
+			}
+			break;
+
+		case DISCOVERY_RESPONSE:
+			memset(&this->capabilities, 0, sizeof(this->capabilities));
+			if (message->size >= CAPABILITY_SIZE)
+				memcpy(&this->capabilities, message->payload, CAPABILITY_SIZE);
+			if (this->onLink != NULL)
+				this->onLink(this, message->type, this->context);
+			break;
+
+		case MESSAGE_ACKNOWLEDGE:
+		case MESSAGE_NEGATIVE_ACKNOWLEDGE:
+			this->acknowledged(message);
+			break;
+
+		case MESSAGE:
+		case FRAGMENT:
+		case COMPRESSED:
+			this->received(message);
+			break;
+
+		case DEBUG:
+			if (this->onStatistics != NULL) {
+				unsigned long counters[STATISTICS_COUNT];
+				byte count = 0;
+
+				//high byte first
+				for (int i = 0; i+4 <= message->size && count < STATISTICS_COUNT; i += 4)
+					counters[count++] = ((unsigned long)message->payload[i] << 24) | ((unsigned long)message->payload[i+1] << 16) | (message->payload[i+2] << 8) | message->payload[i+3];
+				this->onStatistics(this, message->id, counters, count, this->context);
+			}
+			break;
+
+		default:
+			if (this->onReceive != NULL)
+				this->onReceive(this, message, this->context);
+			break;
+	}
+}
+
+void AdvancedSerialClient::acknowledged(const AdvancedSerialMessage* message) {
+	size_t done;
+
+	if (this->inFlight.empty())
+		return;
+
+	if ((this->options & OPTION_WINDOW) == 0) {
+		//one message in flight, a negative acknowledge asks for it again
+		if (message->type == MESSAGE_ACKNOWLEDGE) {
+			this->inFlight.pop_front();
+		} else {
+			Outgoing& rejected = this->inFlight.front();
+			this->transmit(rejected.type, rejected.id, rejected.sequence, rejected.size, rejected.payload);
+			rejected.sentMillis = millis();
+			this->retransmitted++;
+		}
+		return;
+	}
+
+	//everything before the cumulative sequence is delivered
+	done = (byte)(message->id-this->inFlight.front().sequence);
+	if (done > this->inFlight.size())
+		return;
+	this->inFlight.erase(this->inFlight.begin(), this->inFlight.begin()+done);
+
+	//bit i of the bitmap stands for the frame i+1 after the cumulative sequence
+	if (message->size > 0) {
+		for (size_t i = 1; i < this->inFlight.size() && i <= MAX_WINDOW_SIZE; i++) {
+			if (message->payload[0] & (1 << (i-1)))
+				this->inFlight[i].acknowledged = true;
+		}
+	}
+	if (message->size > 1)
+		this->windowLimit = message->payload[1];
+
+	//a rejected frame is resent at once instead of waiting for the timeout
+	if (message->type == MESSAGE_NEGATIVE_ACKNOWLEDGE && !this->inFlight.empty()) {
+		Outgoing& rejected = this->inFlight.front();
+		this->transmit(rejected.type, rejected.id, rejected.sequence, rejected.size, rejected.payload);
+		rejected.sentMillis = millis();
+		this->retransmitted++;
+	}
+}
+
+void AdvancedSerialClient::received(const AdvancedSerialMessage* message) {
+	AdvancedSerialMessage next;
+	byte offset;
+
+	if ((this->options & OPTION_WINDOW) == 0) {
+		this->acknowledge(MESSAGE_ACKNOWLEDGE);
+		this->deliver(message);
+		return;
+	}
+
+	offset = message->sequence-this->receiveSequence;
+	if (offset == 0) {
+		//in order, straight from the read buffer
+		this->receiveSequence++;
+		this->deliver(message);
+
+		//then whatever was held behind the gap it filled
+		while (this->held[this->receiveSequence % MAX_WINDOW_SIZE].present) {
+			Held& slot = this->held[this->receiveSequence % MAX_WINDOW_SIZE];
+			next.type = slot.type;
+			next.id = slot.id;
+			next.size = slot.size;
+			next.sequence = this->receiveSequence++;
+			next.payload = slot.payload;
+			this->deliver(&next);
+			slot.present = false;
+		}
+	} else if (offset < MAX_WINDOW_SIZE && !this->held[message->sequence % MAX_WINDOW_SIZE].present) {
+		//ahead of a gap, keep a copy until the gap is filled
+		Held& slot = this->held[message->sequence % MAX_WINDOW_SIZE];
+		slot.present = true;
+		slot.type = message->type;
+		slot.id = message->id;
+		slot.size = message->size;
+		memcpy(slot.payload, message->payload, message->size);
+	}
+
+	this->acknowledge(MESSAGE_ACKNOWLEDGE);
+}
+
+void AdvancedSerialClient::deliver(const AdvancedSerialMessage* message) {
+	byte index, count;
+
+	if (message->type == COMPRESSED) {
+		this->decompress(message);
+		return;
+	}
+	if (message->type != FRAGMENT) {
+		if (this->onReceive != NULL)
+			this->onReceive(this, message, this->context);
+		return;
+	}
+	if (message->size < FRAGMENT_HEADER_SIZE)
+		return;
+
+	//the link delivers in order, a first fragment always starts over
+	index = message->payload[0];
+	count = message->payload[1];
+	if (index == 0) {
+		this->assembly.clear();
+		this->assemblyIndex = 0;
+	}
+	if (index != this->assemblyIndex || index >= count) {
+		this->assemblyIndex = -1;
+		return;
+	}
+
+	this->assembly.insert(this->assembly.end(), message->payload+FRAGMENT_HEADER_SIZE, message->payload+message->size);
+	this->assemblyIndex++;
+	if (this->assemblyIndex == count) {
+		this->assemblyIndex = -1;
+		if (this->onBulkReceive != NULL)
+			this->onBulkReceive(this, message->id, this->assembly.empty() ? NULL : &this->assembly[0], this->assembly.size(), this->context);
+	}
+}
+
+//control bytes: 0x80|n stands for n+1 zero bytes, n below 0x80 for the n+1 literal bytes after it
+static bool decodeRuns(const byte* data, size_t size, byte* target, size_t capacity, size_t* length) {
+	size_t count;
+
+	*length = 0;
+	for (size_t i = 0; i < size; ) {
+		count = (data[i] & 0x7F)+1;
+		if (*length+count > capacity)
+			return false;
+		if (data[i++] & 0x80) {
+			memset(target+*length, 0, count);
+		} else {
+			if (i+count > size)
+				return false;
+			memcpy(target+*length, data+i, count);
+			i += count;
+		}
+		*length += count;
+	}
+	return true;
+}
+
+void AdvancedSerialClient::decompress(const AdvancedSerialMessage* message) {
+	byte decoded[MESSAGE_MAX_PAYLOAD_SIZE];
+	AdvancedSerialMessage plain;
+	size_t length;
+	bool keyframe;
+	byte counter;
+
+	if (message->size < COMPRESSED_HEADER_SIZE)
+		return;
+	Reference& reference = this->references[message->id];
+	keyframe = (message->payload[0] & 0x80) != 0;
+	counter = message->payload[0] & 0x7F;
+
+	//a delta only applies on top of the frame right before it, after a loss wait for a keyframe
+	if (!keyframe && (!reference.valid || counter != ((reference.counter+1) & 0x7F))) {
+		reference.valid = false;
+		return;
+	}
+	if (!decodeRuns(message->payload+COMPRESSED_HEADER_SIZE, message->size-COMPRESSED_HEADER_SIZE, decoded, sizeof(decoded), &length) ||
+		(!keyframe && length != reference.size)) {
+		reference.valid = false;
+		return;
+	}
+
+	if (keyframe) {
+		memcpy(reference.payload, decoded, length);
+	} else {
+		for (size_t i = 0; i < length; i++)
+			reference.payload[i] ^= decoded[i];
+	}
+	reference.valid = true;
+	reference.counter = counter;
+	reference.size = length;
+
+	//handed over as the plain message the board sent
+	plain.type = MESSAGE;
+	plain.id = message->id;
+	plain.size = reference.size;
+	plain.sequence = message->sequence;
+	plain.payload = reference.payload;
+	if (this->onReceive != NULL)
+		this->onReceive(this, &plain, this->context);
+}
+
+void AdvancedSerialClient::acknowledge(byte type) {
+	byte state[2];
+
+	if ((this->options & OPTION_WINDOW) == 0) {
+		this->transmit(type, 0, 0, 0, NULL);
+		return;
+	}
+
+	//next expected sequence, frames held beyond it, and free slots
+	state[0] = 0;
+	for (int i = 0; i < MAX_WINDOW_SIZE-1; i++) {
+		if (this->held[(byte)(this->receiveSequence+1+i) % MAX_WINDOW_SIZE].present)
+			state[0] |= 1 << i;
+	}
+	state[1] = MAX_WINDOW_SIZE;
+	this->transmit(type, this->receiveSequence, 0, 2, state);
+}
+
+int AdvancedSerialClient::nextTimeout() const {
+	unsigned long now = millis();
+	unsigned long elapsed;
+	long timeout = -1;
+	long remaining;
+
+	if (this->fd < 0)
+		return -1;
+	if (this->switching) {
+		elapsed = now-this->switchMillis;
+		return (elapsed >= this->retransmitTimeout) ? 0 : this->retransmitTimeout-elapsed;
+	}
+
+	for (size_t i = 0; i < this->inFlight.size(); i++) {
+		if (this->inFlight[i].acknowledged)
+			continue;
+		elapsed = now-this->inFlight[i].sentMillis;
+		remaining = (elapsed >= this->retransmitTimeout) ? 0 : this->retransmitTimeout-elapsed;
+		if (timeout < 0 || remaining < timeout)
+			timeout = remaining;
+	}
+	return timeout;
+}
+
+void AdvancedSerialClient::expire() {
+	unsigned long now = millis();
+	byte request[2];
+
+	if (this->fd < 0)
+		return;
+
+	if (this->switching) {
+		if (now-this->switchMillis >= this->retransmitTimeout && this->previousBaud != 0) {
+			//keep asking at the new rate until the board must have fallen back, then follow it
+			if (now-this->baudMillis < BAUD_FALLBACK_TIMEOUT) {
+				this->confirmBaud();
+				return;
+			}
+			this->setSpeed(this->previousBaud);
+			this->previousBaud = 0;
+		}
+
+		//no confirmation, the board may have switched already: rediscover and ask again in plain framing
+		if (now-this->switchMillis >= this->retransmitTimeout) {
+			this->requestedBaud = 0;
+			this->setOptions(0);
+			this->transmit(DISCOVERY_REQUEST, 0, 0, 0, NULL);
+			request[0] = this->requestedOptions;
+			request[1] = MAX_WINDOW_SIZE;
+			this->transmit(SETUP_REQUEST, 0, 0, 2, request);
+			this->switchMillis = now;
+			this->flush();
+		}
+		return;
+	}
+
+	for (size_t i = 0; i < this->inFlight.size(); i++) {
+		Outgoing& message = this->inFlight[i];
+		if (message.acknowledged || now-message.sentMillis < this->retransmitTimeout)
+			continue;
+		this->transmit(message.type, message.id, message.sequence, message.size, message.payload);
+		message.sentMillis = now;
+		this->retransmitted++;
+	}
+	this->pump();
+	this->flush();
+}
+
+}
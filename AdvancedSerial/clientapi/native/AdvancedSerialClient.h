@@ -0,0 +1,274 @@
+/*
+  AdvancedSerialClient.h - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  Native host client for AdvancedSerial, speaking the same frames as the
+  firmware and the .NET SerialProtocol. Each board is one non-blocking file
+  descriptor wrapped in an AdvancedSerialClient; any number of them are
+  driven from a single thread by AdvancedSerialPoller.
+
+  Received frames are parsed in place, the message handed to the receiver
+  points into the read buffer and is only valid during the callback. Sends
+  never block: messages are queued, kept in flight up to the negotiated
+  window and retransmitted until acknowledged.
+*/
+
+#ifndef AdvancedSerialClient_h
+#define AdvancedSerialClient_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <map>
+#include <type_traits>
+#include <vector>
+
+namespace ebl_arduino {
+
+typedef uint8_t byte;
+
+//must match MESSAGE_MAX_PAYLOAD_SIZE in the firmware
+#ifndef MESSAGE_MAX_PAYLOAD_SIZE
+#define MESSAGE_MAX_PAYLOAD_SIZE 32
+#endif
+
+enum MessageTypes {
+	DEBUG = 0x01,
+	MESSAGE = 0x02,
+	MESSAGE_ACKNOWLEDGE = 0x03,
+	DISCOVERY_REQUEST = 0x04,
+	DISCOVERY_RESPONSE = 0x05,
+	SETUP_REQUEST = 0x06,
+	SETUP_RESPONSE = 0x07,
+	MESSAGE_NEGATIVE_ACKNOWLEDGE = 0x08,
+	FRAGMENT = 0x09,
+	COMPRESSED = 0x0A
+};
+
+enum LinkOptions {
+	OPTION_STUFFING = 0x01,
+	OPTION_CHECKSUM = 0x02,
+	OPTION_WINDOW = 0x04,
+	SUPPORTED_OPTIONS = OPTION_STUFFING|OPTION_CHECKSUM|OPTION_WINDOW
+};
+
+//order of the counters a board reports to requestStatistics()
+enum Statistics {
+	FRAMES_RECEIVED,
+	FRAMES_SENT,
+	ACKNOWLEDGES_SENT,
+	ACKNOWLEDGES_RECEIVED,
+	SIZE_REJECTS,
+	DELIMITER_ERRORS,
+	CHECKSUM_ERRORS,
+	BYTES_DISCARDED,
+	RECEIVE_OVERRUNS,
+	TRANSMIT_STALLS,
+	RETRANSMITS,
+	URGENT_FRAMES_SENT,
+	NORMAL_QUEUE_DELAY,
+	URGENT_QUEUE_DELAY,
+	NORMAL_QUEUE_DELAY_MAX,
+	URGENT_QUEUE_DELAY_MAX,
+	STATISTICS_COUNT
+};
+
+struct AdvancedSerialMessage {
+	byte type;
+	byte id;
+	byte size;
+	byte sequence;
+	const byte* payload;
+};
+
+//what a board reports in its DISCOVERY_RESPONSE, all zero for boards predating it
+struct AdvancedSerialCapabilities {
+	byte version;
+	byte maxPayload;
+	byte options;
+	byte bauds;
+};
+
+class AdvancedSerialPoller;
+
+class AdvancedSerialClient
+{
+  public:
+	static const int MESSAGE_HEADER_SIZE = 3;
+	static const int SEQUENCE_SIZE = 1;
+	static const int CHECKSUM_SIZE = 2;
+	static const int FRAGMENT_HEADER_SIZE = 2;
+	static const int COMPRESSED_HEADER_SIZE = 1;
+	static const int MAX_WINDOW_SIZE = 8;
+	static const int CAPABILITY_SIZE = 4;
+	static const int BAUD_RATES = 8;
+	static const byte NO_BAUD = 0xFF;
+	static const unsigned long BAUD_FALLBACK_TIMEOUT = 1000;
+
+    AdvancedSerialClient();
+	~AdvancedSerialClient();
+	bool open(const char* path, int baud);
+	void attach(int fd, int baud = 0);
+	void close();
+	int descriptor() const;
+	bool isOpen() const;
+
+	void setReceiver(void (*onReceive)(AdvancedSerialClient* client, const AdvancedSerialMessage* message, void* context), void* context);
+	void setBulkReceiver(void (*onBulkReceive)(AdvancedSerialClient* client, byte id, const byte* data, size_t size, void* context));
+	void setLinkReceiver(void (*onLink)(AdvancedSerialClient* client, byte type, void* context));
+	void setStatisticsReceiver(void (*onStatistics)(AdvancedSerialClient* client, byte first, const unsigned long* counters, byte count, void* context));
+
+	void discover();
+	void setup(byte options, int baud = 0);
+	bool send(byte id, byte size, const byte* payload);
+	template<class T> bool send(byte id, const T& value);
+	template<class T> static const T* payload(const AdvancedSerialMessage* message);
+	bool sendBulk(byte id, const byte* data, size_t size);
+	void requestStatistics(byte first = 0);
+	size_t pending() const;
+	byte getOptions() const;
+	const AdvancedSerialCapabilities& getCapabilities() const;
+	int getBaud() const;
+	int fastestBaud() const;
+
+	//time until the next retransmission is due, -1 if nothing is in flight
+	int nextTimeout() const;
+	bool wantsWrite() const;
+	void readable();
+	void writable();
+	void expire();
+
+	unsigned long retransmitTimeout;
+	unsigned long retransmitted;
+
+  private:
+	friend class AdvancedSerialPoller;
+
+	struct Outgoing {
+		byte type;
+		byte id;
+		byte sequence;
+		byte size;
+		byte payload[MESSAGE_MAX_PAYLOAD_SIZE];
+		unsigned long sentMillis;
+		bool acknowledged;
+	};
+
+	struct Held {
+		bool present;
+		byte type;
+		byte id;
+		byte size;
+		byte payload[MESSAGE_MAX_PAYLOAD_SIZE];
+	};
+
+	//payload last decoded for a compressed id
+	struct Reference {
+		bool valid;
+		byte counter;
+		byte size;
+		byte payload[MESSAGE_MAX_PAYLOAD_SIZE];
+	};
+
+	int fd;
+	bool owned;
+	AdvancedSerialPoller* poller;
+	byte options;
+	int headerSize;
+
+	std::vector<byte> input;
+	size_t inputSize;
+	std::vector<byte> output;
+	size_t outputHead;
+
+	std::deque<Outgoing> queued;
+	std::deque<Outgoing> inFlight;
+	byte windowSequence;
+	byte windowLimit;
+	bool switching;
+	byte requestedOptions;
+	unsigned long switchMillis;
+	AdvancedSerialCapabilities capabilities;
+	int baud;
+	int previousBaud;
+	int requestedBaud;
+	unsigned long baudMillis;
+	bool watchingWrite;
+
+	byte receiveSequence;
+	Held held[MAX_WINDOW_SIZE];
+	std::vector<byte> assembly;
+	int assemblyIndex;
+	std::map<byte, Reference> references;
+
+	void (*onReceive)(AdvancedSerialClient* client, const AdvancedSerialMessage* message, void* context);
+	void (*onBulkReceive)(AdvancedSerialClient* client, byte id, const byte* data, size_t size, void* context);
+	void (*onLink)(AdvancedSerialClient* client, byte type, void* context);
+	void (*onStatistics)(AdvancedSerialClient* client, byte first, const unsigned long* counters, byte count, void* context);
+	void* context;
+
+	void setOptions(byte options);
+	bool setSpeed(int baud);
+	void confirmBaud();
+	void transmit(byte type, byte id, byte sequence, byte size, const byte* payload);
+	void encode(byte data);
+	void queue(byte type, byte id, byte size, const byte* payload);
+	void pump();
+	void flush();
+	size_t parse(byte* data, size_t size);
+	bool frameReceived(byte* frame, size_t size);
+	void messageReceived(const AdvancedSerialMessage* message);
+	void acknowledged(const AdvancedSerialMessage* message);
+	void received(const AdvancedSerialMessage* message);
+	void deliver(const AdvancedSerialMessage* message);
+	void decompress(const AdvancedSerialMessage* message);
+	void acknowledge(byte type);
+};
+
+//typed payloads use the firmware layout: packed, multi-byte fields little-endian
+template<class T> inline void verifyPayload() {
+	static_assert(std::is_trivially_copyable<T>::value, "payload must be trivially copyable");
+	static_assert(alignof(T) == 1, "payload must be declared __attribute__((packed))");
+	static_assert(sizeof(T) <= MESSAGE_MAX_PAYLOAD_SIZE, "payload must fit in one frame");
+	static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "payloads are read in place, the host must be little-endian like the AVR");
+}
+
+template<class T> bool AdvancedSerialClient::send(byte id, const T& value) {
+	verifyPayload<T>();
+	return this->send(id, sizeof(T), (const byte*)&value);
+}
+
+//the payload in place as a T, NULL when the size does not match
+template<class T> const T* AdvancedSerialClient::payload(const AdvancedSerialMessage* message) {
+	verifyPayload<T>();
+	return (message->size == sizeof(T)) ? (const T*)message->payload : NULL;
+}
+
+}
+
+#endif
@@ -0,0 +1,123 @@
+/*
+  AdvancedSerialPoller.cpp - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <algorithm>
+#include "AdvancedSerialPoller.h"
+
+namespace ebl_arduino {
+
+AdvancedSerialPoller::AdvancedSerialPoller() {
+	this->epollFd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+AdvancedSerialPoller::~AdvancedSerialPoller() {
+	while (!this->clients.empty())
+		this->remove(this->clients.back());
+	if (this->epollFd >= 0)
+		close(this->epollFd);
+}
+
+bool AdvancedSerialPoller::add(AdvancedSerialClient* client) {
+	struct epoll_event event;
+
+	if (this->epollFd < 0 || !client->isOpen() || client->poller != NULL)
+		return false;
+
+	event.events = EPOLLIN | (client->wantsWrite() ? (int)EPOLLOUT : 0);
+	event.data.ptr = client;
+	if (epoll_ctl(this->epollFd, EPOLL_CTL_ADD, client->descriptor(), &event) < 0)
+		return false;
+
+	client->poller = this;
+	client->watchingWrite = client->wantsWrite();
+	this->clients.push_back(client);
+	return true;
+}
+
+void AdvancedSerialPoller::remove(AdvancedSerialClient* client) {
+	std::vector<AdvancedSerialClient*>::iterator position = std::find(this->clients.begin(), this->clients.end(), client);
+
+	if (position == this->clients.end())
+		return;
+	epoll_ctl(this->epollFd, EPOLL_CTL_DEL, client->descriptor(), NULL);
+	client->poller = NULL;
+	this->clients.erase(position);
+}
+
+size_t AdvancedSerialPoller::size() const {
+	return this->clients.size();
+}
+
+void AdvancedSerialPoller::update(AdvancedSerialClient* client) {
+	struct epoll_event event;
+
+	event.events = EPOLLIN | (client->wantsWrite() ? (int)EPOLLOUT : 0);
+	event.data.ptr = client;
+	if (epoll_ctl(this->epollFd, EPOLL_CTL_MOD, client->descriptor(), &event) == 0)
+		client->watchingWrite = client->wantsWrite();
+}
+
+int AdvancedSerialPoller::poll(int timeout) {
+	struct epoll_event events[POLLER_MAX_EVENTS];
+	std::vector<AdvancedSerialClient*> active;
+	AdvancedSerialClient* client;
+	int ready, deadline;
+
+	//wake up in time for the nearest retransmission
+	for (size_t i = 0; i < this->clients.size(); i++) {
+		deadline = this->clients[i]->nextTimeout();
+		if (deadline >= 0 && (timeout < 0 || deadline < timeout))
+			timeout = deadline;
+	}
+
+	ready = epoll_wait(this->epollFd, events, POLLER_MAX_EVENTS, timeout);
+	if (ready < 0)
+		return (errno == EINTR) ? 0 : -1;
+
+	for (int i = 0; i < ready; i++) {
+		client = (AdvancedSerialClient*)events[i].data.ptr;
+		//a client closed earlier in this batch has already left the list
+		if (std::find(this->clients.begin(), this->clients.end(), client) == this->clients.end())
+			continue;
+		if (events[i].events & EPOLLOUT)
+			client->writable();
+		if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			client->readable();
+	}
+
+	//callbacks may close clients, walk a copy
+	active = this->clients;
+	for (size_t i = 0; i < active.size(); i++)
+		active[i]->expire();
+	return ready;
+}
+
+}
@@ -0,0 +1,65 @@
+/*
+  AdvancedSerialPoller.h - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  Single-threaded epoll loop over any number of AdvancedSerialClient boards.
+  Each poll() waits for input, output space or the nearest retransmission
+  deadline, whichever comes first.
+*/
+
+#ifndef AdvancedSerialPoller_h
+#define AdvancedSerialPoller_h
+
+#include <vector>
+#include "AdvancedSerialClient.h"
+
+namespace ebl_arduino {
+
+#define POLLER_MAX_EVENTS 64
+
+class AdvancedSerialPoller
+{
+  public:
+    AdvancedSerialPoller();
+	~AdvancedSerialPoller();
+	bool add(AdvancedSerialClient* client);
+	void remove(AdvancedSerialClient* client);
+	int poll(int timeout);
+	size_t size() const;
+
+  private:
+	friend class AdvancedSerialClient;
+
+	int epollFd;
+	std::vector<AdvancedSerialClient*> clients;
+	void update(AdvancedSerialClient* client);
+};
+
+}
+
+#endif
@@ -0,0 +1,211 @@
+/*
+  Loopback.cpp - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  Drives a number of simulated boards from one AdvancedSerialPoller. Each
+  board is a child process running the firmware on a pseudo-terminal; the
+  client discovers it, negotiates every link option, then checks that all
+  messages and one bulk message come back intact and in order.
+
+  usage: Loopback [boards] [messages]
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "AdvancedSerialClient.h"
+#include "AdvancedSerialPoller.h"
+
+using namespace ebl_arduino;
+
+#define BULK_SIZE 1000
+
+void deviceRun(int fd);
+
+struct Board {
+	AdvancedSerialClient client;
+	pid_t pid;
+	int sent;
+	int received;
+	int errors;
+	bool bulkDone;
+};
+
+static int messages = 1000;
+static byte bulk[BULK_SIZE];
+
+static void sendNext(Board* board) {
+	byte payload[8];
+
+	//a few delimiter values in every payload keep the stuffing honest
+	while (board->sent < messages && board->client.pending() < 16) {
+		memcpy(payload, &board->sent, sizeof(int));
+		payload[4] = 0x02;
+		payload[5] = 0x03;
+		payload[6] = 0x10;
+		payload[7] = board->sent & 0xFF;
+		board->client.send(board->sent & 0xFF, sizeof(payload), payload);
+		board->sent++;
+	}
+}
+
+static void onLink(AdvancedSerialClient* client, byte type, void* context) {
+	Board* board = (Board*)context;
+
+	if (type == DISCOVERY_RESPONSE)
+		client->setup(OPTION_STUFFING|OPTION_CHECKSUM|OPTION_WINDOW, client->fastestBaud());
+	else if (type == SETUP_RESPONSE)
+		sendNext(board);
+}
+
+static void onReceive(AdvancedSerialClient* client, const AdvancedSerialMessage* message, void* context) {
+	Board* board = (Board*)context;
+	int counter;
+
+	memcpy(&counter, message->payload, sizeof(int));
+	if (message->size != 8 || counter != board->received || message->id != (board->received & 0xFF))
+		board->errors++;
+	board->received++;
+
+	if (board->received == messages)
+		client->sendBulk(0x42, bulk, sizeof(bulk));
+	else
+		sendNext(board);
+}
+
+static void onBulkReceive(AdvancedSerialClient* client, byte id, const byte* data, size_t size, void* context) {
+	Board* board = (Board*)context;
+
+	if (id != 0x42 || size != sizeof(bulk) || memcmp(data, bulk, size) != 0)
+		board->errors++;
+	board->bulkDone = true;
+}
+
+static int openBoard(Board* board) {
+	struct termios settings;
+	int master, slave;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+		return -1;
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	if (slave < 0)
+		return -1;
+
+	//no line discipline between the two ends
+	tcgetattr(slave, &settings);
+	cfmakeraw(&settings);
+	tcsetattr(slave, TCSANOW, &settings);
+
+	board->pid = fork();
+	if (board->pid == 0) {
+		close(master);
+		fcntl(slave, F_SETFL, fcntl(slave, F_GETFL) | O_NONBLOCK);
+		deviceRun(slave);
+		_exit(0);
+	}
+	close(slave);
+	return master;
+}
+
+int main(int argc, char** argv) {
+	int boards = (argc > 1) ? atoi(argv[1]) : 4;
+	struct timespec start, end;
+	AdvancedSerialPoller poller;
+	Board* board;
+	bool done = false;
+	int failed = 0;
+	int masters[256];
+	double seconds;
+
+	if (argc > 2)
+		messages = atoi(argv[2]);
+	if (boards < 1 || boards > 256) {
+		fprintf(stderr, "usage: Loopback [boards] [messages]\n");
+		return 1;
+	}
+	for (int i = 0; i < BULK_SIZE; i++)
+		bulk[i] = rand();
+
+	Board* list = new Board[boards];
+	for (int i = 0; i < boards; i++) {
+		board = list+i;
+		board->sent = board->received = board->errors = 0;
+		board->bulkDone = false;
+		masters[i] = openBoard(board);
+		if (masters[i] < 0) {
+			perror("pseudo-terminal");
+			return 1;
+		}
+		board->client.attach(masters[i], 115200);
+		board->client.setReceiver(onReceive, board);
+		board->client.setBulkReceiver(onBulkReceive);
+		board->client.setLinkReceiver(onLink);
+		poller.add(&board->client);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < boards; i++)
+		list[i].client.discover();
+
+	while (!done) {
+		poller.poll(100);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		seconds = (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/1e9;
+
+		done = seconds > 30;
+		if (!done) {
+			done = true;
+			for (int i = 0; i < boards; i++)
+				done = done && list[i].bulkDone;
+		}
+	}
+
+	printf("board  options  messages  errors  bulk\n");
+	for (int i = 0; i < boards; i++) {
+		board = list+i;
+		printf("%5d  %7d  %8d  %6d  %s\n", i, board->client.getOptions(), board->received, board->errors, board->bulkDone ? "ok" : "missing");
+		if (board->received != messages || board->errors > 0 || !board->bulkDone)
+			failed++;
+		board->client.close();
+		close(masters[i]);
+		kill(board->pid, SIGTERM);
+		waitpid(board->pid, NULL, 0);
+	}
+	printf("%d boards, %.2f s, %.0f messages/s\n", boards, seconds, boards*messages*2/seconds);
+
+	delete[] list;
+	return failed > 0 ? 1 : 0;
+}
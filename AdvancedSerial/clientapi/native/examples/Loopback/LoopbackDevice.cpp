@@ -0,0 +1,102 @@
+/*
+  LoopbackDevice.cpp - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+  Board side of the loopback example: the AdvancedSerial firmware, built for
+  the host, behind the slave end of a pseudo-terminal. Every message is sent
+  back unchanged, bulk messages too.
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include "AdvancedSerial.h"
+
+static int deviceFd;
+static byte bulkBuffer[1024];
+static byte echoBuffer[1024];
+
+static void onWrite(const byte* data, size_t size) {
+	ssize_t written;
+
+	while (size > 0) {
+		written = write(deviceFd, data, size);
+		if (written < 0 && errno != EINTR && errno != EAGAIN)
+			_exit(0);
+		if (written > 0) {
+			data += written;
+			size -= written;
+		}
+	}
+}
+
+static void onBulk(byte id, byte* data, unsigned int size) {
+	//the buffer must outlive the transfer, the receive buffer does not
+	if (AdvancedSerial.bulkPending() == 0 && size <= sizeof(echoBuffer)) {
+		memcpy(echoBuffer, data, size);
+		AdvancedSerial.sendBulk(id, echoBuffer, size);
+	}
+}
+
+void deviceRun(int fd) {
+	struct pollfd port;
+	byte data[SERIAL_BUFFER_SIZE];
+	AdvancedSerialMessage* message;
+	ssize_t received;
+	int space;
+
+	deviceFd = fd;
+	AdvancedSerial.begin(115200);
+	Serial.setSink(onWrite);
+	AdvancedSerial.setBulkReceiver(bulkBuffer, sizeof(bulkBuffer), onBulk);
+
+	port.fd = fd;
+	port.events = POLLIN;
+	while (true) {
+		poll(&port, 1, 1);
+
+		//no more than the receive ring takes, as the UART would
+		space = SERIAL_BUFFER_SIZE-1-Serial.available();
+		if (space > 0) {
+			received = read(fd, data, space);
+			if (received == 0 || (received < 0 && errno != EAGAIN && errno != EINTR))
+				return;
+			if (received > 0)
+				Serial.feed(data, received);
+		}
+
+		AdvancedSerial.loop();
+
+		//echo, a message leaves the queue only once its answer is queued
+		while ((message = AdvancedSerial.receive()) != NULL) {
+			if (AdvancedSerial.send(message->id, message->size, message->payload) != SEND_OK)
+				break;
+			AdvancedSerial.release();
+		}
+	}
+}
@@ -17,9 +17,11 @@ void setup() {
   //configure LCD
   lcd.begin(16, 2);
   //begin serial port with a desirable speed
-  Serial.begin(115200);
-  //configure receiver callback
-  AdvancedSerial.setReceiver(onMessage);
+  AdvancedSerial.begin(115200);
+  //configure one handler per message, backlight messages carry no payload
+  AdvancedSerial.setHandler(BACKLIGHT_ON_MESSAGE, onBacklightOn, 0);
+  AdvancedSerial.setHandler(BACKLIGHT_OFF_MESSAGE, onBacklightOff, 0);
+  AdvancedSerial.setHandler(TEXT_MESSAGE, onText);
 }
 
 void loop() {
@@ -27,22 +29,18 @@ void loop() {
   AdvancedSerial.loop();
 }
 
-void onMessage(AdvancedSerialMessage* message) {
-  switch (message->id) {
-    case BACKLIGHT_ON_MESSAGE:
-      digitalWrite(PIN_BACKLIGHT, HIGH);
-      break;
-      
-    case BACKLIGHT_OFF_MESSAGE:
-      digitalWrite(PIN_BACKLIGHT, LOW);
-      break;
-      
-    case TEXT_MESSAGE:
-      lcd.clear();
-      for (int i=0; i<message->size; i++) {
-        if (i==16) lcd.setCursor(0, 1);
-        lcd.write((char)message->payload[i]);
-      }
-      break;
+void onBacklightOn(AdvancedSerialMessage* message) {
+  digitalWrite(PIN_BACKLIGHT, HIGH);
+}
+
+void onBacklightOff(AdvancedSerialMessage* message) {
+  digitalWrite(PIN_BACKLIGHT, LOW);
+}
+
+void onText(AdvancedSerialMessage* message) {
+  lcd.clear();
+  for (int i=0; i<message->size; i++) {
+    if (i==16) lcd.setCursor(0, 1);
+    lcd.write((char)message->payload[i]);
   }
 }
@@ -0,0 +1,15 @@
+//payloads shared with the host, kept out of the sketch so the generated
+//prototypes can use them; the host declares the same fields in the same order
+
+#define SETPOINT_MESSAGE 0
+#define READING_MESSAGE 1
+
+struct Setpoint {
+  int target;
+  byte hysteresis;
+} __attribute__((packed));
+
+struct Reading {
+  int value;
+  unsigned long time;
+} __attribute__((packed));
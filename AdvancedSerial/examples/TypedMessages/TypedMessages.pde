@@ -0,0 +1,40 @@
+#include <AdvancedSerial.h>
+#include "Payloads.h"
+
+//pins
+#define PIN_SENSOR 0
+#define PIN_HEATER 9
+
+Setpoint setpoint = { 512, 8 };
+unsigned long lastReading = 0;
+
+void setup() {
+  pinMode(PIN_HEATER, OUTPUT);
+  //begin serial port with a desirable speed
+  AdvancedSerial.begin(115200);
+  //frames of any other size than a Setpoint never reach onSetpoint
+  AdvancedSerial.setHandler<Setpoint, onSetpoint>(SETPOINT_MESSAGE);
+}
+
+void loop() {
+  Reading reading;
+
+  //AdvancedSerial job
+  AdvancedSerial.loop();
+
+  if (millis()-lastReading >= 1000) {
+    lastReading = millis();
+    reading.value = analogRead(PIN_SENSOR);
+    reading.time = lastReading;
+    AdvancedSerial.send(READING_MESSAGE, reading);
+
+    if (reading.value < setpoint.target-setpoint.hysteresis)
+      digitalWrite(PIN_HEATER, HIGH);
+    else if (reading.value > setpoint.target+setpoint.hysteresis)
+      digitalWrite(PIN_HEATER, LOW);
+  }
+}
+
+void onSetpoint(const Setpoint& value) {
+  setpoint = value;
+}
@@ -28,11 +28,35 @@
 
 #include "AnalogEvent.h"
 
+#ifdef ANALOG_ASYNC
+#include <avr/interrupt.h>
+
+#if defined(ADCSRA)
+//set by analogReference() in wiring_analog.c
+extern uint8_t analog_reference;
+
+ISR(ADC_vect) {
+	AnalogEvent.sampled(ADC);
+}
+#endif
+#endif
+
 AnalogEventClass::AnalogEventClass() {
 	this->count = 0;
+#ifdef ANALOG_ASYNC
+	this->async = false;
+	this->fresh = false;
+	this->back = 0;
+#endif
 }
 
 void AnalogEventClass::addAnalogPort(short pin, void (*onChange)(AnalogPortInformation* Sender), int hysteresis) {
+#ifdef ANALOG_ASYNC
+	//the interrupt must not write into the table while it moves
+	if (this->async)
+		this->stopAsync();
+#endif
+
 	if (this->count > 0) {
 		this->ports = (AnalogPortInformation*) realloc(this->ports, sizeof(AnalogPortInformation)*(this->count+1));
 	} else {
@@ -44,33 +68,232 @@ void AnalogEventClass::addAnalogPort(short pin, void (*onChange)(AnalogPortInfor
 	this->currentPort->value = -99; //force the first event change
 	this->currentPort->onChange = onChange;
 	this->currentPort->hysteresis = hysteresis;
+	this->currentPort->filter = NULL;
 
 	this->count++;
+
+#ifdef ANALOG_ASYNC
+	if (this->async)
+		this->startAsync();
+#endif
 }
 
 void AnalogEventClass::setPosition(short Position) {
 	this->currentPort = this->ports+Position;
 }
 
+//filter: FILTER_OVERSAMPLE, FILTER_EMA or FILTER_AVERAGE, optionally or'ed with FILTER_MEDIAN
+//depth: oversample 4^depth readings for depth extra bits, EMA weight 1/2^depth or an average of 2^depth readings
+void AnalogEventClass::addAnalogPort(short pin, void (*onChange)(AnalogPortInformation* Sender), int hysteresis, byte filter, byte depth) {
+	AnalogFilterInformation* information;
+	size_t size;
+
+	this->addAnalogPort(pin, onChange, hysteresis);
+	if (filter == FILTER_NONE)
+		return;
+
+	if ((filter & FILTER_STAGE) == FILTER_OVERSAMPLE && depth > MAX_OVERSAMPLE_DEPTH)
+		depth = MAX_OVERSAMPLE_DEPTH;
+	if ((filter & FILTER_STAGE) == FILTER_EMA && depth > MAX_EMA_DEPTH)
+		depth = MAX_EMA_DEPTH;
+	if ((filter & FILTER_STAGE) == FILTER_AVERAGE && depth > MAX_AVERAGE_DEPTH)
+		depth = MAX_AVERAGE_DEPTH;
+
+	size = offsetof(AnalogFilterInformation, window);
+	if ((filter & FILTER_STAGE) == FILTER_AVERAGE)
+		size += sizeof(int) << depth;
+	information = (AnalogFilterInformation*) malloc(size);
+	if (information == NULL)
+		return; //the port stays unfiltered
+	information->type = filter;
+	information->depth = depth;
+	information->count = 0;
+	information->position = MEDIAN_SIZE; //empty median window
+	information->sum = 0;
+	//the port table may have moved, so the new port is looked up again
+	this->ports[this->count-1].filter = information;
+}
+
+#ifdef ANALOG_ASYNC
+//convert ports round robin from the ADC interrupt instead of blocking in analogRead()
+void AnalogEventClass::setAsync(bool async) {
+#if defined(ADCSRA)
+	if (async == this->async)
+		return;
+
+	this->async = async;
+	if (async)
+		this->startAsync();
+	else
+		this->stopAsync();
+#endif
+}
+
+void AnalogEventClass::startAsync() {
+	if (this->count == 0)
+		return;
+
+	this->fresh = false;
+	this->sampling = 0;
+	this->convert(this->ports[0].pin);
+}
+
+void AnalogEventClass::stopAsync() {
+#if defined(ADCSRA)
+	ADCSRA &= ~_BV(ADIE);
+	//let a running conversion finish so the next analogRead() is not disturbed
+	while (ADCSRA & _BV(ADSC));
+	this->fresh = false;
+#endif
+}
+
+//same pin mapping and reference as analogRead()
+void AnalogEventClass::convert(short pin) {
+#if defined(ADCSRA)
+#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+	if (pin >= 54)
+		pin -= 54;
+	ADCSRB = (ADCSRB & ~_BV(MUX5)) | (((pin >> 3) & 0x01) << MUX5);
+#else
+	if (pin >= 14)
+		pin -= 14;
+#endif
+	ADMUX = (analog_reference << 6) | (pin & 0x07);
+	ADCSRA |= _BV(ADIE) | _BV(ADSC);
+#endif
+}
+
+void AnalogEventClass::sampled(int value) {
+	this->ports[this->sampling].samples[this->back] = value;
+
+	if (++this->sampling >= this->count) {
+		this->sampling = 0;
+		//hand the finished round to loop() only once it consumed the previous one
+		if (!this->fresh) {
+			this->back ^= 1;
+			this->fresh = true;
+		}
+	}
+
+	this->convert(this->ports[this->sampling].pin);
+}
+#endif
+
+//median of the last MEDIAN_SIZE readings, rejects single spikes
+int AnalogEventClass::median() {
+	AnalogFilterInformation* information = this->currentPort->filter;
+	int sorted[MEDIAN_SIZE];
+	int value;
+	byte i;
+	byte j;
+
+	if (information->position >= MEDIAN_SIZE) {
+		//fill the window with the first reading
+		for (i = 0; i < MEDIAN_SIZE; i++)
+			information->median[i] = this->nextValue;
+		information->position = 0;
+	}
+	information->median[information->position] = this->nextValue;
+	information->position = (information->position+1) % MEDIAN_SIZE;
+
+	for (i = 0; i < MEDIAN_SIZE; i++) {
+		value = information->median[i];
+		for (j = i; j > 0 && sorted[j-1] > value; j--)
+			sorted[j] = sorted[j-1];
+		sorted[j] = value;
+	}
+	return sorted[MEDIAN_SIZE/2];
+}
+
+//run the reading in nextValue through the port filter, false while no value is due
+bool AnalogEventClass::filter() {
+	AnalogFilterInformation* information = this->currentPort->filter;
+	byte i;
+
+	if (information->type & FILTER_MEDIAN)
+		this->nextValue = this->median();
+
+	switch (information->type & FILTER_STAGE) {
+		case FILTER_OVERSAMPLE:
+			//sum 4^depth readings and decimate by 2^depth, keeping depth extra bits
+			information->sum += this->nextValue;
+			if (++information->count < (1 << (information->depth*2)))
+				return false;
+			this->nextValue = information->sum >> information->depth;
+			information->sum = 0;
+			information->count = 0;
+			break;
+
+		case FILTER_EMA:
+			//sum holds the average scaled by 2^depth
+			if (information->count == 0) {
+				information->sum = (long)this->nextValue << information->depth;
+				information->count = 1;
+			}
+			information->sum += this->nextValue-(information->sum >> information->depth);
+			this->nextValue = information->sum >> information->depth;
+			break;
+
+		case FILTER_AVERAGE:
+			//count is the next window slot plus one, zero before the first reading
+			if (information->count == 0) {
+				for (i = 0; i < (1 << information->depth); i++)
+					information->window[i] = this->nextValue;
+				information->sum = (long)this->nextValue << information->depth;
+				information->count = 1;
+			}
+			information->sum += this->nextValue-information->window[information->count-1];
+			information->window[information->count-1] = this->nextValue;
+			information->count = information->count >= (1 << information->depth) ? 1 : information->count+1;
+			this->nextValue = information->sum >> information->depth;
+			break;
+	}
+	return true;
+}
+
+void AnalogEventClass::update() {
+	if (this->currentPort->value != this->nextValue) {
+		if (this->currentPort->hysteresis > 0) {
+			if (this->currentPort->value-this->nextValue >= this->currentPort->hysteresis ||
+				this->nextValue-this->currentPort->value >= this->currentPort->hysteresis) {
+					this->currentPort->value = this->nextValue;
+					if (this->currentPort->onChange != NULL)
+						this->currentPort->onChange(this->currentPort); //call event					
+				}
+		} else {
+			this->currentPort->value = this->nextValue;
+			if (this->currentPort->onChange != NULL)
+				this->currentPort->onChange(this->currentPort); //call event
+		}
+	}
+}
+
 void AnalogEventClass::loop() {
+#ifdef ANALOG_ASYNC
+	byte front;
+
+	if (this->async) {
+		//nothing to do until the interrupt completed a round of all ports
+		if (!this->fresh)
+			return;
+
+		front = this->back^1;
+		for (this->index = 0; this->index < this->count; this->index++) {
+			this->setPosition(this->index);
+			this->nextValue = this->currentPort->samples[front];
+			if (this->currentPort->filter == NULL || this->filter())
+				this->update();
+		}
+		this->fresh = false;
+		return;
+	}
+#endif
+
 	for (this->index = 0; this->index < this->count; this->index++) {
 		this->setPosition(this->index);
 		this->nextValue = analogRead(this->currentPort->pin);
-		
-		if (this->currentPort->value != this->nextValue) {
-			if (this->currentPort->hysteresis > 0) {
-				if (this->currentPort->value-this->nextValue >= this->currentPort->hysteresis ||
-					this->nextValue-this->currentPort->value >= this->currentPort->hysteresis) {
-						this->currentPort->value = this->nextValue;
-						if (this->currentPort->onChange != NULL)
-							this->currentPort->onChange(this->currentPort); //call event					
-					}
-			} else {
-				this->currentPort->value = this->nextValue;
-				if (this->currentPort->onChange != NULL)
-					this->currentPort->onChange(this->currentPort); //call event
-			}
-		}
+		if (this->currentPort->filter == NULL || this->filter())
+			this->update();
 	}
 }
 
@@ -30,13 +30,48 @@
 #define AnalogEvent_h
 
 #include <stdlib.h>
+#include <stddef.h>
 #include "WProgram.h"
 
+//uncomment to build setAsync(); it takes the ADC complete interrupt vector, so a sketch
+//with its own ADC handler cannot link with it switched on. AnalogEvent.cpp is compiled
+//apart from the sketch, so it has to be switched on here
+//#define ANALOG_ASYNC
+
+#ifndef MEDIAN_SIZE
+#define MEDIAN_SIZE 3
+#endif
+
+#define FILTER_NONE 0x00
+#define FILTER_OVERSAMPLE 0x01
+#define FILTER_EMA 0x02
+#define FILTER_AVERAGE 0x03
+#define FILTER_STAGE 0x0F
+#define FILTER_MEDIAN 0x10
+#define MAX_OVERSAMPLE_DEPTH 3
+#define MAX_EMA_DEPTH 8
+#define MAX_AVERAGE_DEPTH 3
+
+struct AnalogFilterInformation {
+  byte type;
+  byte depth;
+  byte count;
+  byte position;
+  long sum;
+  int median[MEDIAN_SIZE];
+  //must stay last, only FILTER_AVERAGE allocates its 2^depth slots
+  int window[1 << MAX_AVERAGE_DEPTH];
+};
+
 struct AnalogPortInformation {
   short pin;
   int value;
   int hysteresis;
   void (*onChange)(AnalogPortInformation* Sender);
+#ifdef ANALOG_ASYNC
+  volatile int samples[2];
+#endif
+  AnalogFilterInformation* filter;
 };
 
 class AnalogEventClass
@@ -44,15 +79,34 @@ class AnalogEventClass
   public:
     AnalogEventClass();
 	void addAnalogPort(short pin, void (*onChange)(AnalogPortInformation* Sender), int hysteresis);
+	void addAnalogPort(short pin, void (*onChange)(AnalogPortInformation* Sender), int hysteresis, byte filter, byte depth);
+#ifdef ANALOG_ASYNC
+	void setAsync(bool async);
+	void sampled(int value); //called from the ADC complete interrupt
+#endif
 	void loop();
 
   private:
   	short nextValue;
     short count;
 	short index;
+#ifdef ANALOG_ASYNC
+	bool async;
+	volatile short sampling;
+	volatile byte back;
+	volatile bool fresh;
+#endif
     AnalogPortInformation* ports;
 	AnalogPortInformation* currentPort;
 	void setPosition(short Position);
+	void update();
+	bool filter();
+	int median();
+#ifdef ANALOG_ASYNC
+	void convert(short pin);
+	void startAsync();
+	void stopAsync();
+#endif
 };
 
 //global instance
@@ -0,0 +1,24 @@
+#include <AnalogEvent.h>
+
+//needs ANALOG_ASYNC uncommented in AnalogEvent.h
+
+void setup() {
+  //watch all six analog pins without blocking the loop on the ADC
+  for (int pin = 0; pin < 6; pin++)
+    AnalogEvent.addAnalogPort(pin, onChange, 3);
+  AnalogEvent.setAsync(true);
+
+  Serial.begin(9600);
+}
+
+void loop() {
+  AnalogEvent.loop();
+}
+
+void onChange(AnalogPortInformation* Sender) {
+  Serial.print("Analog (pin:");
+  Serial.print(Sender->pin);
+  Serial.print(") changed to: ");
+  Serial.print(Sender->value);
+  Serial.println("!");
+}
@@ -0,0 +1,23 @@
+#include <AnalogEvent.h>
+
+void setup() {
+  AnalogEvent.addAnalogPort(1,                                 //potentiometer pin
+                            onChange,                          //onChange event function
+                            2,                                 //hysteresis, in 12 bit units
+                            FILTER_MEDIAN | FILTER_OVERSAMPLE, //drop spikes, then oversample
+                            2);                                //16 readings for 2 extra bits
+  
+  Serial.begin(9600);
+}
+
+void loop() {
+  AnalogEvent.loop();
+}
+
+void onChange(AnalogPortInformation* Sender) {
+  Serial.print("Analog (pin:");
+  Serial.print(Sender->pin);
+  Serial.print(") changed to: ");
+  Serial.print(Sender->value);
+  Serial.println("!");
+}
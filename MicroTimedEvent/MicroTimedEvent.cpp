@@ -0,0 +1,147 @@
+/*
+  MicroTimedEvent.cpp - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "MicroTimedEvent.h"
+
+MicroTimedEventClass::MicroTimedEventClass() {
+	this->count = 0;
+	this->nextMicros = 0;
+}
+
+MicroTimerInformation* MicroTimedEventClass::addTimer(unsigned long intervalMicros, void (*onEvent)(MicroTimerInformation* Sender)) {
+	if (this->addTimer(DEFAULT_MICRO_TIMER_ID, intervalMicros, onEvent) == NULL)
+		return NULL;
+
+	this->start(this->currentTimer);
+	return this->currentTimer;
+}
+
+MicroTimerInformation* MicroTimedEventClass::addTimer(short eventId, unsigned long intervalMicros, void (*onEvent)(MicroTimerInformation* Sender)) {
+	if (this->count >= MAX_MICRO_TIMERS)
+		return NULL;
+
+	this->setPosition(this->count);
+	this->currentTimer->eventId = eventId;
+	this->currentTimer->intervalMicros = intervalMicros;
+	this->currentTimer->onEvent = onEvent;
+	this->currentTimer->enabled = false;
+	this->currentTimer->lateMicros = 0;
+	this->currentTimer->maxLateMicros = 0;
+	this->currentTimer->missedTicks = 0;
+
+	this->count++;
+	return this->currentTimer;
+}
+
+void MicroTimedEventClass::setPosition(short Position) {
+	this->currentTimer = this->timers+Position;
+}
+
+bool MicroTimedEventClass::findTimer(short eventId) {
+	for (this->index = 0; this->index < this->count; this->index++) {
+		this->setPosition(this->index);
+		
+		if (this->currentTimer->eventId == eventId)
+			return true;
+	}
+	return false;
+}
+
+//cache the earliest deadline so a pass with nothing due is a single compare
+void MicroTimedEventClass::updateNext() {
+	MicroTimerInformation* timer;
+	bool found = false;
+
+	for (timer = this->timers; timer < this->timers+this->count; timer++) {
+		if (timer->enabled && (!found || (long)(timer->nextEventMicros-this->nextMicros) < 0)) {
+			this->nextMicros = timer->nextEventMicros;
+			found = true;
+		}
+	}
+
+	if (!found)
+		this->nextMicros = micros()+0x7FFFFFFF;
+}
+
+void MicroTimedEventClass::loop() {
+	MicroTimerInformation* timer;
+	unsigned long behind;
+
+	this->lastMicros = micros();
+	if ((long)(this->lastMicros-this->nextMicros) < 0)
+		return;
+
+	//callbacks may start or stop timers, so the walk does not use the shared position
+	for (timer = this->timers; timer < this->timers+this->count; timer++) {
+		if (!timer->enabled || (long)(this->lastMicros-timer->nextEventMicros) < 0)
+			continue;
+
+		timer->lateMicros = this->lastMicros-timer->nextEventMicros;
+		if (timer->lateMicros > timer->maxLateMicros)
+			timer->maxLateMicros = timer->lateMicros;
+
+		if (timer->intervalMicros == 0) {
+			timer->nextEventMicros = this->lastMicros+1;
+		} else {
+			//deadlines stay on the interval grid; ticks that already passed are skipped and counted
+			behind = timer->lateMicros/timer->intervalMicros;
+			timer->missedTicks += behind;
+			timer->nextEventMicros += (behind+1)*timer->intervalMicros;
+		}
+		timer->lastEventMicros = this->lastMicros;
+
+		timer->onEvent(timer);
+	}
+
+	this->updateNext();
+}
+
+void MicroTimedEventClass::start(int eventId) {
+	if (this->findTimer(eventId))
+		this->start(this->currentTimer);
+}
+
+void MicroTimedEventClass::start(MicroTimerInformation* timer) {
+	timer->enabled = true;
+	timer->lastEventMicros = micros();
+	timer->nextEventMicros = timer->lastEventMicros+timer->intervalMicros;
+	this->updateNext();
+}
+
+void MicroTimedEventClass::stop(int eventId) {
+	if (this->findTimer(eventId))
+		this->stop(this->currentTimer);
+}
+
+void MicroTimedEventClass::stop(MicroTimerInformation* timer) {
+	timer->enabled = false;
+	this->updateNext();
+}
+
+
+MicroTimedEventClass MicroTimedEvent;
\ No newline at end of file
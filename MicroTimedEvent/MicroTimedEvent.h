@@ -0,0 +1,81 @@
+/*
+  MicroTimedEvent.h - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MicroTimedEvent_h
+#define MicroTimedEvent_h
+
+#include <stdlib.h>
+#include "WProgram.h"
+
+#ifndef MAX_MICRO_TIMERS
+#define MAX_MICRO_TIMERS 4
+#endif
+
+#define DEFAULT_MICRO_TIMER_ID -99
+
+struct MicroTimerInformation {
+	short eventId;
+	bool enabled;
+	unsigned long intervalMicros;
+	unsigned long lastEventMicros;
+	unsigned long nextEventMicros;
+	unsigned long lateMicros;
+	unsigned long maxLateMicros;
+	unsigned long missedTicks;
+	void (*onEvent)(MicroTimerInformation* Sender);
+};
+
+class MicroTimedEventClass
+{
+  public:
+    MicroTimedEventClass();
+	MicroTimerInformation* addTimer(short eventId, unsigned long intervalMicros, void (*onEvent)(MicroTimerInformation* Sender));
+	MicroTimerInformation* addTimer(unsigned long intervalMicros, void (*onEvent)(MicroTimerInformation* Sender));
+	//eventId overloads take an int so a literal 0 does not match the handle overloads
+	void start(int eventId);
+	void start(MicroTimerInformation* timer);
+	void stop(int eventId);
+	void stop(MicroTimerInformation* timer);
+	void loop();
+	
+  private:
+	short count;
+	short index;
+	unsigned long lastMicros;
+	unsigned long nextMicros;
+	MicroTimerInformation timers[MAX_MICRO_TIMERS];
+	MicroTimerInformation* currentTimer;
+	void setPosition(short Position);
+	bool findTimer(short eventId);
+	void updateNext();
+};
+
+//global instance
+extern MicroTimedEventClass MicroTimedEvent;
+
+#endif
\ No newline at end of file
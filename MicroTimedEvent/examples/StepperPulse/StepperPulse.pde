@@ -0,0 +1,34 @@
+#include <MicroTimedEvent.h>
+
+#define STEP_PIN 9
+#define REPORT_TIMER 1
+
+bool level = false;
+MicroTimerInformation* step;
+
+void setup() {
+  Serial.begin(9600);
+  pinMode(STEP_PIN, OUTPUT);
+
+  //toggle the step pin at 2kHz
+  step = MicroTimedEvent.addTimer(250, onStep);
+  //report the measured lateness once a second
+  MicroTimedEvent.addTimer(REPORT_TIMER, 1000000, onReport);
+  MicroTimedEvent.start(REPORT_TIMER);
+}
+
+void loop() {
+  MicroTimedEvent.loop();
+}
+
+void onStep(MicroTimerInformation* Sender) {
+  digitalWrite(STEP_PIN, level = !level);
+}
+
+void onReport(MicroTimerInformation* Sender) {
+  Serial.print("max late us: ");
+  Serial.print(step->maxLateMicros);
+  Serial.print(" missed: ");
+  Serial.println(step->missedTicks);
+  step->maxLateMicros = 0;
+}
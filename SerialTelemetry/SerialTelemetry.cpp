@@ -0,0 +1,164 @@
+/*
+  SerialTelemetry.cpp - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "SerialTelemetry.h"
+
+SerialTelemetryClass::SerialTelemetryClass() {
+	this->count = 0;
+	this->cursor = 0;
+	this->frameInterval = 0;
+	this->lastMillis = 0;
+}
+
+byte SerialTelemetryClass::addSource(byte kind, short pin, short analogValue, unsigned int minInterval) {
+	if (this->count > 0) {
+		this->sources = (TelemetrySource*) realloc(this->sources, sizeof(TelemetrySource)*(this->count+1));
+	} else {
+		this->sources = (TelemetrySource*) malloc(sizeof(TelemetrySource));
+	}
+
+	this->currentSource = this->sources+this->count;
+	this->currentSource->kind = kind;
+	this->currentSource->pin = pin;
+	this->currentSource->analogValue = analogValue;
+	this->currentSource->value = 0;
+	this->currentSource->changed = (kind == TELEMETRY_BUTTON); //the host starts from a released button
+	this->currentSource->minInterval = minInterval;
+	this->currentSource->lastMillis = millis()-minInterval;
+
+	return this->count++;
+}
+
+byte SerialTelemetryClass::addAnalogPort(short pin, int hysteresis, unsigned int minInterval) {
+	AnalogEvent.addAnalogPort(pin, onAnalogChange, hysteresis);
+	return this->addSource(TELEMETRY_ANALOG, pin, NOT_ANALOG, minInterval);
+}
+
+byte SerialTelemetryClass::addButton(short pin, unsigned long holdMillisWait, unsigned long doubleMillisWait, unsigned int minInterval) {
+	ButtonEvent.addButton(pin, onButtonDown, onButtonUp, onButtonHold, holdMillisWait, onButtonDouble, doubleMillisWait);
+	return this->addSource(TELEMETRY_BUTTON, pin, NOT_ANALOG, minInterval);
+}
+
+byte SerialTelemetryClass::addButton(short pin, short analogValue, byte deviation, unsigned long holdMillisWait, unsigned long doubleMillisWait, unsigned int minInterval) {
+	ButtonEvent.addButton(pin, analogValue, deviation, onButtonDown, onButtonUp, onButtonHold, holdMillisWait, onButtonDouble, doubleMillisWait);
+	return this->addSource(TELEMETRY_BUTTON, pin, analogValue, minInterval);
+}
+
+void SerialTelemetryClass::setFrameInterval(unsigned int frameInterval) {
+	this->frameInterval = frameInterval;
+}
+
+void SerialTelemetryClass::refresh() {
+	//send every source again, e.g. after the host reconnects
+	for (byte i = 0; i < this->count; i++)
+		this->sources[i].changed = true;
+}
+
+TelemetrySource* SerialTelemetryClass::findSource(byte kind, short pin, short analogValue) {
+	for (byte i = 0; i < this->count; i++) {
+		this->currentSource = this->sources+i;
+		if (this->currentSource->kind == kind && this->currentSource->pin == pin && this->currentSource->analogValue == analogValue)
+			return this->currentSource;
+	}
+	return NULL;
+}
+
+void SerialTelemetryClass::update(TelemetrySource* source, int value) {
+	//only the latest value is kept, older ones never queue up
+	if (source != NULL) {
+		source->value = value;
+		source->changed = true;
+	}
+}
+
+void SerialTelemetryClass::onAnalogChange(AnalogPortInformation* Sender) {
+	update(SerialTelemetry.findSource(TELEMETRY_ANALOG, Sender->pin, NOT_ANALOG), Sender->value);
+}
+
+void SerialTelemetryClass::onButtonDown(ButtonInformation* Sender) {
+	TelemetrySource* source = SerialTelemetry.findSource(TELEMETRY_BUTTON, Sender->pin, Sender->analogValue);
+	if (source != NULL) update(source, (source->value & ~TELEMETRY_HOLD) | TELEMETRY_PRESSED);
+}
+
+void SerialTelemetryClass::onButtonUp(ButtonInformation* Sender) {
+	TelemetrySource* source = SerialTelemetry.findSource(TELEMETRY_BUTTON, Sender->pin, Sender->analogValue);
+	if (source != NULL) update(source, source->value & ~(TELEMETRY_PRESSED|TELEMETRY_HOLD));
+}
+
+void SerialTelemetryClass::onButtonHold(ButtonInformation* Sender) {
+	TelemetrySource* source = SerialTelemetry.findSource(TELEMETRY_BUTTON, Sender->pin, Sender->analogValue);
+	if (source != NULL) update(source, source->value | TELEMETRY_HOLD);
+}
+
+void SerialTelemetryClass::onButtonDouble(ButtonInformation* Sender) {
+	TelemetrySource* source = SerialTelemetry.findSource(TELEMETRY_BUTTON, Sender->pin, Sender->analogValue);
+	//a double click is a press too, the counter lets the host spot it after coalescing
+	if (source != NULL) update(source, (source->value+TELEMETRY_DOUBLE) | TELEMETRY_PRESSED);
+}
+
+void SerialTelemetryClass::loop() {
+	byte frame[TELEMETRY_FRAME_ENTRIES*TELEMETRY_ENTRY_SIZE];
+	byte included[TELEMETRY_FRAME_ENTRIES];
+	byte entries = 0;
+	byte index;
+	unsigned long now = millis();
+
+	if (this->count == 0 || now-this->lastMillis < this->frameInterval)
+		return;
+
+	//round robin from where the last frame stopped, so no source starves
+	for (byte i = 0; i < this->count && entries < TELEMETRY_FRAME_ENTRIES; i++) {
+		index = this->cursor+i;
+		if (index >= this->count) index -= this->count;
+		this->currentSource = this->sources+index;
+
+		if (this->currentSource->changed && now-this->currentSource->lastMillis >= this->currentSource->minInterval) {
+			frame[entries*TELEMETRY_ENTRY_SIZE] = index;
+			frame[entries*TELEMETRY_ENTRY_SIZE+1] = this->currentSource->value & 0xFF;
+			frame[entries*TELEMETRY_ENTRY_SIZE+2] = (this->currentSource->value >> 8) & 0xFF;
+			included[entries++] = index;
+		}
+	}
+	if (entries == 0)
+		return;
+
+	//a busy link keeps the sources pending, they are sent later with whatever value is latest then
+	if (AdvancedSerial.send(TELEMETRY_MESSAGE, entries*TELEMETRY_ENTRY_SIZE, frame) != SEND_OK)
+		return;
+
+	for (byte i = 0; i < entries; i++) {
+		this->currentSource = this->sources+included[i];
+		this->currentSource->changed = false;
+		this->currentSource->lastMillis = now;
+	}
+	this->cursor = included[entries-1]+1;
+	if (this->cursor >= this->count) this->cursor = 0;
+	this->lastMillis = now;
+}
+
+SerialTelemetryClass SerialTelemetry;
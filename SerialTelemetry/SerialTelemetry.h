@@ -0,0 +1,97 @@
+/*
+  SerialTelemetry.h - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef SerialTelemetry_h
+#define SerialTelemetry_h
+
+#include <stdlib.h>
+#include "WProgram.h"
+#include "AdvancedSerial.h"
+#include "AnalogEvent.h"
+#include "ButtonEvent.h"
+
+//message id of telemetry frames; SerialTelemetry.cpp is compiled apart from the
+//sketch, so a different id has to be set here, not with a #define in the sketch
+#ifndef TELEMETRY_MESSAGE
+#define TELEMETRY_MESSAGE 0xF0
+#endif
+
+//a frame holds entries of source index, then value low and high byte
+#define TELEMETRY_ENTRY_SIZE 3
+#define TELEMETRY_FRAME_ENTRIES (MESSAGE_MAX_PAYLOAD_SIZE/TELEMETRY_ENTRY_SIZE)
+
+#define TELEMETRY_ANALOG 0x01
+#define TELEMETRY_BUTTON 0x02
+
+//button values: state bits, double clicks counted in the high byte
+#define TELEMETRY_PRESSED 0x0001
+#define TELEMETRY_HOLD 0x0002
+#define TELEMETRY_DOUBLE 0x0100
+
+struct TelemetrySource {
+  byte kind;
+  short pin;
+  short analogValue;
+  int value;
+  bool changed;
+  unsigned int minInterval;
+  unsigned long lastMillis;
+};
+
+class SerialTelemetryClass
+{
+  public:
+    SerialTelemetryClass();
+	byte addAnalogPort(short pin, int hysteresis, unsigned int minInterval);
+	byte addButton(short pin, unsigned long holdMillisWait, unsigned long doubleMillisWait, unsigned int minInterval);
+	byte addButton(short pin, short analogValue, byte deviation, unsigned long holdMillisWait, unsigned long doubleMillisWait, unsigned int minInterval);
+	void setFrameInterval(unsigned int frameInterval);
+	void refresh();
+	void loop();
+
+  private:
+	byte count;
+	byte cursor;
+	unsigned int frameInterval;
+	unsigned long lastMillis;
+    TelemetrySource* sources;
+	TelemetrySource* currentSource;
+	byte addSource(byte kind, short pin, short analogValue, unsigned int minInterval);
+	TelemetrySource* findSource(byte kind, short pin, short analogValue);
+	static void onAnalogChange(AnalogPortInformation* Sender);
+	static void onButtonDown(ButtonInformation* Sender);
+	static void onButtonUp(ButtonInformation* Sender);
+	static void onButtonHold(ButtonInformation* Sender);
+	static void onButtonDouble(ButtonInformation* Sender);
+	static void update(TelemetrySource* source, int value);
+};
+
+//global instance
+extern SerialTelemetryClass SerialTelemetry;
+
+#endif
@@ -0,0 +1,25 @@
+#include <AdvancedSerial.h>
+#include <AnalogEvent.h>
+#include <ButtonEvent.h>
+#include <SerialTelemetry.h>
+
+void setup() {
+  SerialTelemetry.addAnalogPort(1,     //potentiometer pin
+                                3,     //hysteresis
+                                100);  //at most one update every 100ms
+  SerialTelemetry.addButton(12,        //button pin
+                            1000,      //hold time in milliseconds
+                            200,       //double time interval
+                            0);        //button changes go out at once
+  SerialTelemetry.setFrameInterval(20); //at most 50 frames per second
+
+  //begin serial port with a desirable speed
+  AdvancedSerial.begin(115200);
+}
+
+void loop() {
+  AdvancedSerial.loop();
+  AnalogEvent.loop();
+  ButtonEvent.loop();
+  SerialTelemetry.loop();
+}
@@ -27,31 +27,63 @@
 */
 
 #include "TimedEvent.h"
+#include <stddef.h>
+#include <string.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+
+#if defined(TIMER_POWER_DOWN) && defined(WDTCSR)
+//kept by the Arduino core in wiring.c
+extern volatile unsigned long timer0_millis;
+
+static volatile bool watchdogFired;
+
+ISR(WDT_vect) {
+	watchdogFired = true;
+}
+#endif
 
 TimedEventClass::TimedEventClass() {
-	this->count = 0;
+	this->heapCount = 0;
+	this->freeCount = 0;
+	this->onIdle = NULL;
+
+	//free slots are handed out from the top of the stack, slot 0 first
+	for (this->index = MAX_TIMERS-1; this->index >= 0; this->index--) {
+		this->timers[this->index].onEvent = NULL;
+		this->freeList[this->freeCount++] = this->index;
+	}
 }
 
-void TimedEventClass::addTimer(unsigned long intervalMillis, void (*onEvent)(TimerInformation* Sender)) {
-	this->addTimer(DEFAULT_TIMER_ID, intervalMillis, onEvent);
-	this->currentTimer->enabled = true;
-	this->currentTimer->lastEventMillis = millis();
+TimerInformation* TimedEventClass::addTimer(unsigned long intervalMillis, void (*onEvent)(TimerInformation* Sender)) {
+	if (this->addTimer(DEFAULT_TIMER_ID, intervalMillis, onEvent) == NULL)
+		return NULL;
+
+	this->start(this->currentTimer);
+	return this->currentTimer;
 }
 
-void TimedEventClass::addTimer(short eventId, unsigned long intervalMillis, void (*onEvent)(TimerInformation* Sender)) {
-	if (this->count > 0) {
-		this->timers = (TimerInformation*) realloc(this->timers, sizeof(TimerInformation)*(this->count+1));
-	} else {
-		this->timers = (TimerInformation*) malloc(sizeof(TimerInformation));
-	}
+TimerInformation* TimedEventClass::addTimer(short eventId, unsigned long intervalMillis, void (*onEvent)(TimerInformation* Sender)) {
+	//the pool is fixed, so timers never move and Sender pointers stay valid;
+	//a timer without a callback could never be found or removed again
+	if (onEvent == NULL || this->freeCount == 0)
+		return NULL;
 
-	this->setPosition(this->count);
+	this->setPosition(this->freeList[--this->freeCount]);
 	this->currentTimer->eventId = eventId;
 	this->currentTimer->intervalMillis = intervalMillis; 
 	this->currentTimer->onEvent = onEvent;
 	this->currentTimer->enabled = false;
-	
-	this->count++;
+	this->currentTimer->mode = TIMER_FIXED_DELAY;
+	this->currentTimer->heapIndex = NOT_SCHEDULED;
+	this->currentTimer->ticks = 0;
+	this->currentTimer->missedTicks = 0;
+#ifdef TIMER_STATISTICS
+	memset(&this->currentTimer->firings, 0, sizeof(TimerInformation)-offsetof(TimerInformation, firings));
+#endif
+
+	return this->currentTimer;
 }
 
 void TimedEventClass::setPosition(short Position) {
@@ -59,42 +91,328 @@ void TimedEventClass::setPosition(short Position) {
 }
 
 bool TimedEventClass::findTimer(short eventId) {
-	for (this->index = 0; this->index < this->count; this->index++) {
+	for (this->index = 0; this->index < MAX_TIMERS; this->index++) {
 		this->setPosition(this->index);
 		
-		if (this->currentTimer->eventId == eventId)
+		if (this->currentTimer->onEvent != NULL && this->currentTimer->eventId == eventId)
 			return true;
 	}
 	return false;
 }
 
+//deadlines are compared by difference so the order survives millis() rollover
+bool TimedEventClass::isBefore(short first, short second) {
+	return (long)(this->timers[this->heap[first]].nextEventMillis-this->timers[this->heap[second]].nextEventMillis) < 0;
+}
+
+void TimedEventClass::swap(short first, short second) {
+	short timer = this->heap[first];
+
+	this->heap[first] = this->heap[second];
+	this->heap[second] = timer;
+	this->timers[this->heap[first]].heapIndex = first;
+	this->timers[this->heap[second]].heapIndex = second;
+}
+
+void TimedEventClass::siftUp(short position) {
+	short parent;
+
+	while (position > 0) {
+		parent = (position-1)/2;
+		if (!this->isBefore(position, parent))
+			break;
+		this->swap(position, parent);
+		position = parent;
+	}
+}
+
+void TimedEventClass::siftDown(short position) {
+	short child;
+
+	for (;;) {
+		child = position*2+1;
+		if (child >= this->heapCount)
+			break;
+		if (child+1 < this->heapCount && this->isBefore(child+1, child))
+			child++;
+		if (!this->isBefore(child, position))
+			break;
+		this->swap(position, child);
+		position = child;
+	}
+}
+
+//(re)insert the current timer in the heap by its next deadline
+void TimedEventClass::schedule() {
+	short position = this->currentTimer->heapIndex;
+
+	this->currentTimer->nextEventMillis = this->currentTimer->lastEventMillis+this->currentTimer->intervalMillis;
+	if (position == NOT_SCHEDULED) {
+		position = this->heapCount++;
+		this->heap[position] = this->currentTimer-this->timers;
+		this->currentTimer->heapIndex = position;
+	}
+	this->siftUp(position);
+	this->siftDown(this->currentTimer->heapIndex);
+}
+
+void TimedEventClass::unschedule() {
+	short position = this->currentTimer->heapIndex;
+
+	if (position == NOT_SCHEDULED)
+		return;
+
+	this->currentTimer->heapIndex = NOT_SCHEDULED;
+	this->heapCount--;
+	if (position == this->heapCount)
+		return;
+
+	//move the last entry into the hole and restore the order around it
+	this->heap[position] = this->heap[this->heapCount];
+	this->currentTimer = this->timers+this->heap[position];
+	this->currentTimer->heapIndex = position;
+	this->siftUp(position);
+	this->siftDown(this->currentTimer->heapIndex);
+}
+
+//move the deadline of the fired timer on top of the heap
+void TimedEventClass::advance() {
+	unsigned long behind;
+
+	this->currentTimer->ticks = 1;
+
+	if (this->currentTimer->mode == TIMER_FIXED_DELAY || this->currentTimer->intervalMillis == 0) {
+		//the next interval counts from now, so loop latency adds up as drift
+		this->currentTimer->nextEventMillis = this->lastMillis+this->currentTimer->intervalMillis;
+		//a zero interval fires once per millisecond instead of spinning in this pass
+		if (this->currentTimer->intervalMillis == 0)
+			this->currentTimer->nextEventMillis++;
+	} else {
+		//fixed rate: deadlines stay on multiples of the interval from start()
+		behind = (this->lastMillis-this->currentTimer->nextEventMillis)/this->currentTimer->intervalMillis;
+
+		if (this->currentTimer->mode == TIMER_CATCH_UP) {
+			//late ticks fire back to back until the timer is on time again
+			this->currentTimer->nextEventMillis += this->currentTimer->intervalMillis;
+		} else {
+			//skip or coalesce the ticks that already passed
+			this->currentTimer->missedTicks += behind;
+			if (this->currentTimer->mode == TIMER_COALESCE)
+				this->currentTimer->ticks += behind;
+			this->currentTimer->nextEventMillis += (behind+1)*this->currentTimer->intervalMillis;
+		}
+	}
+
+	this->siftDown(0);
+}
+
 void TimedEventClass::loop() {
-	for (this->index = 0; this->index < this->count; this->index++) {
-		this->setPosition(this->index);
-		
-		if (this->currentTimer->enabled) {
-			this->lastMillis = millis();
-			
-			if (this->currentTimer->lastEventMillis+this->currentTimer->intervalMillis <= this->lastMillis) {
-				this->currentTimer->lastEventMillis = this->lastMillis;
-				this->currentTimer->onEvent(this->currentTimer);
-			}
+	unsigned long idleMillis;
+#ifdef TIMER_STATISTICS
+	TimerInformation* timer;
+	unsigned long lateMillis;
+	unsigned long startMicros;
+#endif
+
+	if (this->heapCount > 0) {
+		this->lastMillis = millis();
+		while (this->heapCount > 0) {
+			this->setPosition(this->heap[0]);
+
+			if ((long)(this->lastMillis-this->currentTimer->nextEventMillis) < 0)
+				break;
+
+#ifdef TIMER_STATISTICS
+			timer = this->currentTimer;
+			lateMillis = this->lastMillis-timer->nextEventMillis;
+#endif
+			this->currentTimer->lastEventMillis = this->lastMillis;
+			this->advance();
+#ifdef TIMER_STATISTICS
+			startMicros = micros();
+			timer->onEvent(timer);
+			this->record(timer, lateMillis, micros()-startMicros);
+#else
+			this->currentTimer->onEvent(this->currentTimer);
+#endif
 		}
 	}
+
+	if (this->onIdle != NULL) {
+		idleMillis = this->nextDeadline();
+		if (idleMillis > 0)
+			this->onIdle(idleMillis);
+	}
+}
+
+//milliseconds until the earliest timer is due, NO_DEADLINE when none is running
+unsigned long TimedEventClass::nextDeadline() {
+	long remaining;
+
+	if (this->heapCount == 0)
+		return NO_DEADLINE;
+
+	remaining = this->timers[this->heap[0]].nextEventMillis-millis();
+	return remaining > 0 ? remaining : 0;
+}
+
+void TimedEventClass::setIdle(void (*onIdle)(unsigned long idleMillis)) {
+	this->onIdle = onIdle;
+}
+
+//idle sleep keeps timer0 running: the timer0 interrupt wakes it every millisecond, so
+//loop() comes back at that rate and millis() needs no correction
+void TimedEventClass::sleepIdle(unsigned long idleMillis) {
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_mode();
 }
 
-void TimedEventClass::start(short eventId) {
-	if (this->findTimer(eventId)) {
-		this->currentTimer->enabled = true;
-		this->currentTimer->lastEventMillis = millis();
+#ifdef TIMER_POWER_DOWN
+//power down until the watchdog period that fits the idle time ends, or an interrupt
+void TimedEventClass::sleepPowerDown(unsigned long idleMillis) {
+#if defined(WDTCSR)
+	byte prescaler = 0;
+
+	if (idleMillis < WATCHDOG_MIN_MILLIS) {
+		sleepIdle(idleMillis);
+		return;
+	}
+
+	while (prescaler < WDTO_8S && ((unsigned long)WATCHDOG_MIN_MILLIS << (prescaler+1)) <= idleMillis)
+		prescaler++;
+
+	watchdogFired = false;
+	cli();
+	MCUSR &= ~_BV(WDRF);
+	WDTCSR = _BV(WDCE) | _BV(WDE);
+	WDTCSR = _BV(WDIE) | (prescaler & 0x07) | ((prescaler & 0x08) ? _BV(WDP3) : 0);
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	sleep_enable();
+	//interrupts are only taken after sleep_cpu(), so the watchdog cannot be missed
+	sei();
+	sleep_cpu();
+	sleep_disable();
+	wdt_disable();
+
+	//timer0 stops in power down; credit the watchdog period, a wake-up by another interrupt is not credited
+	if (watchdogFired) {
+		cli();
+		timer0_millis += (unsigned long)WATCHDOG_MIN_MILLIS << prescaler;
+		sei();
 	}
+#else
+	sleepIdle(idleMillis);
+#endif
+}
+#endif
+
+void TimedEventClass::start(int eventId) {
+	if (this->findTimer(eventId))
+		this->start(this->currentTimer);
+}
+
+void TimedEventClass::start(TimerInformation* timer) {
+	//a removed timer stays out of the heap
+	if (timer->onEvent == NULL)
+		return;
+
+	this->currentTimer = timer;
+	this->currentTimer->enabled = true;
+	this->currentTimer->lastEventMillis = millis();
+	this->schedule();
+}
+
+void TimedEventClass::stop(int eventId) {
+	if (this->findTimer(eventId))
+		this->stop(this->currentTimer);
+}
+
+void TimedEventClass::stop(TimerInformation* timer) {
+	if (timer->onEvent == NULL)
+		return;
+
+	this->currentTimer = timer;
+	this->currentTimer->enabled = false;
+	this->unschedule();
+}
+
+void TimedEventClass::remove(int eventId) {
+	if (this->findTimer(eventId))
+		this->remove(this->currentTimer);
+}
+
+void TimedEventClass::remove(TimerInformation* timer) {
+	if (timer->onEvent == NULL)
+		return;
+
+	this->stop(timer);
+	timer->onEvent = NULL;
+	this->freeList[this->freeCount++] = timer-this->timers;
+}
+
+void TimedEventClass::setMode(int eventId, byte mode) {
+	if (this->findTimer(eventId))
+		this->setMode(this->currentTimer, mode);
+}
+
+void TimedEventClass::setMode(TimerInformation* timer, byte mode) {
+	timer->mode = mode;
 }
 
-void TimedEventClass::stop(short eventId) {
-	if (this->findTimer(eventId)) {
-		this->currentTimer->enabled = false;
+
+#ifdef TIMER_STATISTICS
+void TimedEventClass::record(TimerInformation* timer, unsigned long lateMillis, unsigned long durationMicros) {
+	byte bucket = 0;
+
+	timer->firings++;
+	timer->lateMillisSum += lateMillis;
+	if (lateMillis > timer->lateMillisMax)
+		timer->lateMillisMax = lateMillis;
+	timer->durationMicrosSum += durationMicros;
+	if (durationMicros > timer->durationMicrosMax)
+		timer->durationMicrosMax = durationMicros;
+
+	while (bucket < TIMER_HISTOGRAM_BUCKETS-1 && durationMicros >= ((unsigned long)TIMER_HISTOGRAM_BASE << bucket))
+		bucket++;
+	if (timer->histogram[bucket] < 0xFFFF)
+		timer->histogram[bucket]++;
+}
+
+void TimedEventClass::resetStatistics() {
+	for (this->index = 0; this->index < MAX_TIMERS; this->index++) {
+		this->setPosition(this->index);
+		memset(&this->currentTimer->firings, 0, sizeof(TimerInformation)-offsetof(TimerInformation, firings));
 	}
 }
 
+//one line per timer: id, firings, late mean/max (ms), duration mean/max (us), histogram
+void TimedEventClass::printStatistics(Print& output) {
+	byte bucket;
+
+	for (this->index = 0; this->index < MAX_TIMERS; this->index++) {
+		this->setPosition(this->index);
+		if (this->currentTimer->onEvent == NULL)
+			continue;
+
+		output.print((int)this->currentTimer->eventId);
+		output.print(" fired ");
+		output.print(this->currentTimer->firings);
+		output.print(" late ");
+		output.print(this->currentTimer->firings > 0 ? this->currentTimer->lateMillisSum/this->currentTimer->firings : 0);
+		output.print("/");
+		output.print(this->currentTimer->lateMillisMax);
+		output.print("ms run ");
+		output.print(this->currentTimer->firings > 0 ? this->currentTimer->durationMicrosSum/this->currentTimer->firings : 0);
+		output.print("/");
+		output.print(this->currentTimer->durationMicrosMax);
+		output.print("us |");
+		for (bucket = 0; bucket < TIMER_HISTOGRAM_BUCKETS; bucket++) {
+			output.print(" ");
+			output.print((unsigned int)this->currentTimer->histogram[bucket]);
+		}
+		output.println();
+	}
+}
+#endif
 
 TimedEventClass TimedEvent;
\ No newline at end of file
@@ -32,34 +32,101 @@
 #include <stdlib.h>
 #include "WProgram.h"
 
+#ifndef MAX_TIMERS
+#define MAX_TIMERS 8
+#endif
+
+//uncomment to collect lateness and callback duration for every timer
+//#define TIMER_STATISTICS
+
+#define TIMER_HISTOGRAM_BUCKETS 8
+#define TIMER_HISTOGRAM_BASE 16
+
+//uncomment to build sleepPowerDown(); it takes the watchdog interrupt vector, so a
+//sketch with its own watchdog handler cannot link with it switched on
+//#define TIMER_POWER_DOWN
+
 #define DEFAULT_TIMER_ID -99
+#define NOT_SCHEDULED -1
+#define TIMER_FIXED_DELAY 0
+#define TIMER_SKIP 1
+#define TIMER_CATCH_UP 2
+#define TIMER_COALESCE 3
+#define NO_DEADLINE 0xFFFFFFFF
+#define WATCHDOG_MIN_MILLIS 16
 
 struct TimerInformation {
 	short eventId;
 	bool enabled;
+	byte mode;
 	unsigned long intervalMillis;
 	unsigned long lastEventMillis;
+	unsigned long nextEventMillis;
+	short heapIndex;
+	unsigned long ticks;
+	unsigned long missedTicks;
 	void (*onEvent)(TimerInformation* Sender);
+#ifdef TIMER_STATISTICS
+	unsigned long firings;
+	unsigned long lateMillisSum;
+	unsigned long lateMillisMax;
+	unsigned long durationMicrosSum;
+	unsigned long durationMicrosMax;
+	//bucket n counts callbacks shorter than TIMER_HISTOGRAM_BASE<<n us, the last one the rest
+	unsigned short histogram[TIMER_HISTOGRAM_BUCKETS];
+#endif
 };
 
 class TimedEventClass
 {
   public:
     TimedEventClass();
-	void addTimer(short eventId, unsigned long intervalMillis, void (*onEvent)(TimerInformation* Sender));
-	void addTimer(unsigned long intervalMillis, void (*onEvent)(TimerInformation* Sender));
-	void start(short eventId);
-	void stop(short eventId);
+	//a handle is valid until its timer is removed, the slot then goes to the next addTimer()
+	TimerInformation* addTimer(short eventId, unsigned long intervalMillis, void (*onEvent)(TimerInformation* Sender));
+	TimerInformation* addTimer(unsigned long intervalMillis, void (*onEvent)(TimerInformation* Sender));
+	//eventId overloads take an int so a literal 0 does not match the handle overloads
+	void start(int eventId);
+	void start(TimerInformation* timer);
+	void stop(int eventId);
+	void stop(TimerInformation* timer);
+	void remove(int eventId);
+	void remove(TimerInformation* timer);
+	void setMode(int eventId, byte mode);
+	void setMode(TimerInformation* timer, byte mode);
+	unsigned long nextDeadline();
+	void setIdle(void (*onIdle)(unsigned long idleMillis));
+	static void sleepIdle(unsigned long idleMillis);
+#ifdef TIMER_POWER_DOWN
+	static void sleepPowerDown(unsigned long idleMillis);
+#endif
 	void loop();
+#ifdef TIMER_STATISTICS
+	void resetStatistics();
+	void printStatistics(Print& output);
+#endif
 	
   private:
-	short count;
 	short index;
+	short heapCount;
+	short freeCount;
 	unsigned long lastMillis;
-    TimerInformation* timers;
+	TimerInformation timers[MAX_TIMERS];
 	TimerInformation* currentTimer;
+	void (*onIdle)(unsigned long idleMillis);
+	short heap[MAX_TIMERS];
+	short freeList[MAX_TIMERS];
 	void setPosition(short Position);
 	bool findTimer(short eventId);
+	bool isBefore(short first, short second);
+	void swap(short first, short second);
+	void siftUp(short position);
+	void siftDown(short position);
+	void schedule();
+	void advance();
+	void unschedule();
+#ifdef TIMER_STATISTICS
+	void record(TimerInformation* timer, unsigned long lateMillis, unsigned long durationMicros);
+#endif
 };
 
 //global instance
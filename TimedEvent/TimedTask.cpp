@@ -0,0 +1,81 @@
+/*
+  TimedTask.cpp - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "TimedTask.h"
+
+TimedTaskClass::TimedTaskClass() {
+	byte index;
+
+	for (index = 0; index < MAX_TASKS; index++)
+		this->tasks[index].run = NULL;
+}
+
+//the task runs from the next TimedEvent.loop() pass on
+TaskInformation* TimedTaskClass::addTask(void (*run)(TaskInformation* Task)) {
+	TaskInformation* task;
+
+	for (task = this->tasks; task < this->tasks+MAX_TASKS; task++) {
+		if (task->run != NULL)
+			continue;
+
+		task->timer = TimedEvent.addTimer(TASK_TIMER_ID, 0, onTimer);
+		if (task->timer == NULL)
+			return NULL;
+
+		task->line = 0;
+		task->run = run;
+		TimedEvent.start(task->timer);
+		return task;
+	}
+	return NULL;
+}
+
+//resume the task after intervalMillis; zero polls it once per millisecond
+void TimedTaskClass::sleep(TaskInformation* task, unsigned long intervalMillis) {
+	task->timer->intervalMillis = intervalMillis > 0 ? intervalMillis : 1;
+	TimedEvent.start(task->timer);
+}
+
+void TimedTaskClass::finish(TaskInformation* task) {
+	TimedEvent.remove(task->timer);
+	task->run = NULL;
+}
+
+void TimedTaskClass::onTimer(TimerInformation* Sender) {
+	TaskInformation* task;
+
+	for (task = TimedTask.tasks; task < TimedTask.tasks+MAX_TASKS; task++) {
+		if (task->run != NULL && task->timer == Sender) {
+			task->run(task);
+			return;
+		}
+	}
+}
+
+
+TimedTaskClass TimedTask;
\ No newline at end of file
@@ -0,0 +1,70 @@
+/*
+  TimedTask.h - Event-Based Library for Arduino.
+  Copyright (c) 2011, Renato A. Ferreira
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of the <organization> nor the
+        names of its contributors may be used to endorse or promote products
+        derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef TimedTask_h
+#define TimedTask_h
+
+#include "TimedEvent.h"
+
+#ifndef MAX_TASKS
+#define MAX_TASKS 4
+#endif
+
+#define TASK_TIMER_ID -98
+
+//stackless tasks: locals do not survive an await, keep state in statics or globals,
+//and do not await from inside a switch statement of the task body
+#define TASK_BEGIN(task) switch ((task)->line) { case 0:
+#define TASK_END(task) } (task)->line = 0; TimedTask.finish(task); return
+#define TASK_AWAIT_MS(task, ms) do { (task)->line = __LINE__; TimedTask.sleep(task, ms); return; case __LINE__:; } while (0)
+#define TASK_AWAIT_UNTIL(task, condition) do { (task)->line = __LINE__; TimedTask.sleep(task, 0); case __LINE__: if (!(condition)) return; } while (0)
+#define TASK_YIELD(task) do { (task)->line = __LINE__; TimedTask.sleep(task, 0); return; case __LINE__:; } while (0)
+
+struct TaskInformation {
+	unsigned short line;
+	TimerInformation* timer;
+	void (*run)(TaskInformation* Task);
+};
+
+class TimedTaskClass
+{
+  public:
+    TimedTaskClass();
+	TaskInformation* addTask(void (*run)(TaskInformation* Task));
+	void sleep(TaskInformation* task, unsigned long intervalMillis);
+	void finish(TaskInformation* task);
+	
+  private:
+	TaskInformation tasks[MAX_TASKS];
+	static void onTimer(TimerInformation* Sender);
+};
+
+//global instance
+extern TimedTaskClass TimedTask;
+
+#endif
\ No newline at end of file
@@ -0,0 +1,25 @@
+#include <TimedEvent.h>
+
+#define SAMPLE_TIMER 1
+
+void setup() {
+  Serial.begin(9600);
+
+  //sample every 100ms on a fixed grid, merging ticks lost to a slow loop
+  TimedEvent.addTimer(SAMPLE_TIMER, 100, onSample);
+  TimedEvent.setMode(SAMPLE_TIMER, TIMER_COALESCE);
+  TimedEvent.start(SAMPLE_TIMER);
+}
+
+void loop() {
+  TimedEvent.loop();
+}
+
+void onSample(TimerInformation* Sender) {
+  Serial.print("sample: ");
+  Serial.print(analogRead(0));
+  Serial.print(" ticks: ");
+  Serial.print(Sender->ticks);
+  Serial.print(" missed: ");
+  Serial.println(Sender->missedTicks);
+}
@@ -0,0 +1,21 @@
+#include <TimedEvent.h>
+
+//needs TIMER_POWER_DOWN uncommented in TimedEvent.h
+
+void setup() {
+  pinMode(13, OUTPUT);
+
+  //blink every 2 seconds and power down in between
+  TimedEvent.addTimer(2000, onBlink);
+  TimedEvent.setIdle(TimedEventClass::sleepPowerDown);
+}
+
+void loop() {
+  TimedEvent.loop();
+}
+
+void onBlink(TimerInformation* Sender) {
+  digitalWrite(13, HIGH);
+  delay(50);
+  digitalWrite(13, LOW);
+}
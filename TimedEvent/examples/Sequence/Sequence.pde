@@ -0,0 +1,36 @@
+#include <TimedEvent.h>
+#include <TimedTask.h>
+
+#define LED_PIN 13
+#define BUTTON_PIN 2
+
+void setup() {
+  Serial.begin(9600);
+  pinMode(LED_PIN, OUTPUT);
+  pinMode(BUTTON_PIN, INPUT);
+
+  TimedTask.addTask(sequence);
+  //other timers keep running while the task waits
+  TimedEvent.addTimer(1000, onSecond);
+}
+
+void loop() {
+  TimedEvent.loop();
+}
+
+void sequence(TaskInformation* Task) {
+  TASK_BEGIN(Task);
+  for (;;) {
+    digitalWrite(LED_PIN, HIGH);
+    TASK_AWAIT_MS(Task, 200);
+    digitalWrite(LED_PIN, LOW);
+    TASK_AWAIT_UNTIL(Task, digitalRead(BUTTON_PIN) == HIGH);
+    Serial.println("pressed!");
+    TASK_AWAIT_UNTIL(Task, digitalRead(BUTTON_PIN) == LOW);
+  }
+  TASK_END(Task);
+}
+
+void onSecond(TimerInformation* Sender) {
+  Serial.println("tick");
+}